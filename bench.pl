@@ -0,0 +1,246 @@
+#!/usr/bin/perl
+# Throughput and metadata benchmarks against a freshly formatted image.
+#
+#   perl bench.pl [--frontend nufs_ll] [--backend direct] [--cache-mb 256]
+#                 [--image-mb 512] [--file-mb 64] [--files 2000]
+#                 [--entries 10000] [--depth 32] [--out bench.json]
+#
+# Prints a table and writes the same numbers as JSON, so two builds can be
+# compared with a diff. Data is re-read after a remount so the kernel page
+# cache can't answer for the file system. --backend and --cache-mb set
+# NUFS_BACKEND and NUFS_CACHE_MB for the mounts, see blocks.h.
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Fcntl qw(O_RDONLY O_WRONLY O_CREAT O_TRUNC SEEK_SET);
+use Getopt::Long;
+use JSON::PP;
+use POSIX qw(strftime);
+use Time::HiRes qw(time sleep);
+
+my %opt = (
+    "frontend" => "nufs",
+    "backend"  => "mmap",
+    "cache-mb" => 256,
+    "image-mb" => 512,
+    "file-mb"  => 64,
+    "files"    => 2000,
+    "entries"  => 10000,
+    "depth"    => 32,
+    "out"      => "bench.json",
+);
+GetOptions(\%opt, "frontend=s", "backend=s", "cache-mb=i", "image-mb=i",
+           "file-mb=i", "files=i", "entries=i", "depth=i", "out=s")
+    or die "bad arguments\n";
+$ENV{NUFS_BACKEND} = $opt{backend};
+$ENV{NUFS_CACHE_MB} = $opt{"cache-mb"};
+
+my $image = "bench.nufs";
+my $log = "bench.log";
+my @io_sizes = (4096, 65536, 1 << 20);
+my %results;
+my $pid;
+
+# data phases let the kernel send large writes, metadata phases make it ask
+# the file system on every lookup instead of trusting its own caches (the
+# low level frontend sets its own timeouts in each reply)
+my $data_opts = "-obig_writes";
+my $meta_opts = "-oentry_timeout=0,attr_timeout=0,negative_timeout=0";
+
+sub mount {
+    my ($fuse_opts) = @_;
+    my $dev = (stat ".")[0];
+    $pid = fork();
+    if ($pid == 0) {
+        open STDOUT, ">>", $log or die;
+        open STDERR, ">&", \*STDOUT or die;
+        exec("./$opt{frontend}", "-f", $fuse_opts, "mnt", $image);
+        die "exec $opt{frontend}: $!";
+    }
+    for (1..200) {
+        return if (stat "mnt")[0] != $dev;
+        sleep 0.05;
+    }
+    die "mount failed, see $log\n";
+}
+
+sub unmount {
+    return unless $pid;
+    system("fusermount -u mnt");
+    waitpid($pid, 0);
+    $pid = undef;
+}
+
+END {
+    unmount();
+}
+
+sub percentile {
+    my ($sorted, $p) = @_;
+    return 0 unless @$sorted;
+    return $sorted->[int($p * $#$sorted + 0.5)];
+}
+
+# record a phase given the latency of each operation in seconds, the time
+# the whole phase took and how many bytes it moved
+sub record {
+    my ($name, $lats, $elapsed, $bytes) = @_;
+    my @sorted = sort { $a <=> $b } @$lats;
+    my $res = {
+        ops         => scalar(@sorted),
+        ops_per_sec => @sorted / $elapsed,
+        p50_us      => percentile(\@sorted, 0.50) * 1e6,
+        p99_us      => percentile(\@sorted, 0.99) * 1e6,
+    };
+    $res->{mb_per_sec} = $bytes / $elapsed / (1 << 20) if $bytes;
+    $results{$name} = $res;
+    printf("%-22s %8d ops %10.0f ops/s %10.1f us p50 %10.1f us p99 %s\n",
+           $name, $res->{ops}, $res->{ops_per_sec}, $res->{p50_us},
+           $res->{p99_us},
+           $bytes ? sprintf("%8.1f MB/s", $res->{mb_per_sec}) : "");
+}
+
+# time a function once for each of the given arguments
+sub timed {
+    my ($fn, @args) = @_;
+    my @lats;
+    my $start = time();
+    for my $arg (@args) {
+        my $t0 = time();
+        $fn->($arg);
+        push @lats, time() - $t0;
+    }
+    return (\@lats, time() - $start);
+}
+
+sub open_file {
+    my ($name, $flags) = @_;
+    sysopen(my $fh, "mnt/$name", $flags, 0644) or die "open $name: $!";
+    return $fh;
+}
+
+sub touch {
+    my ($name) = @_;
+    my $fh = open_file($name, O_WRONLY | O_CREAT);
+    close $fh;
+}
+
+sub bench_data {
+    my ($size) = @_;
+    my $label = $size >= (1 << 20) ? ($size >> 20) . "M" : ($size >> 10) . "K";
+    my $name = "data_$label";
+    my $count = int($opt{"file-mb"} * (1 << 20) / $size);
+    my $rand_count = $count < 4096 ? $count : 4096;
+    my $buf = "x" x $size;
+    my ($fh, $lats, $elapsed);
+
+    mount($data_opts);
+    $fh = open_file($name, O_WRONLY | O_CREAT | O_TRUNC);
+    ($lats, $elapsed) = timed(sub {
+        syswrite($fh, $buf) == $size or die "write: $!";
+    }, 1..$count);
+    close $fh;
+    record("seq_write_$label", $lats, $elapsed, $count * $size);
+
+    unmount();
+    mount($data_opts);
+    $fh = open_file($name, O_RDONLY);
+    ($lats, $elapsed) = timed(sub {
+        sysread($fh, my $data, $size) == $size or die "read: $!";
+    }, 1..$count);
+    close $fh;
+    record("seq_read_$label", $lats, $elapsed, $count * $size);
+
+    my @offsets = map { int(rand($count)) * $size } 1..$rand_count;
+    unmount();
+    mount($data_opts);
+    $fh = open_file($name, O_RDONLY);
+    ($lats, $elapsed) = timed(sub {
+        sysseek($fh, $_[0], SEEK_SET);
+        sysread($fh, my $data, $size) == $size or die "read: $!";
+    }, @offsets);
+    close $fh;
+    record("rand_read_$label", $lats, $elapsed, $rand_count * $size);
+
+    $fh = open_file($name, O_WRONLY);
+    ($lats, $elapsed) = timed(sub {
+        sysseek($fh, $_[0], SEEK_SET);
+        syswrite($fh, $buf) == $size or die "write: $!";
+    }, @offsets);
+    close $fh;
+    record("rand_write_$label", $lats, $elapsed, $rand_count * $size);
+
+    unlink("mnt/$name");
+    unmount();
+}
+
+sub bench_small_files {
+    my @names = map { "small/f$_" } 1..$opt{files};
+    mount($meta_opts);
+    mkdir("mnt/small");
+    record("create", timed(sub {
+        touch($_[0]);
+    }, @names));
+    record("stat", timed(sub {
+        stat("mnt/$_[0]") or die "stat $_[0]: $!";
+    }, @names));
+    record("unlink", timed(sub {
+        unlink("mnt/$_[0]") or die "unlink $_[0]: $!";
+    }, @names));
+    rmdir("mnt/small");
+    unmount();
+}
+
+sub bench_readdir {
+    mount($meta_opts);
+    mkdir("mnt/big");
+    for my $ii (1..$opt{entries}) {
+        touch("big/entry_$ii");
+    }
+    my ($lats, $elapsed) = timed(sub {
+        opendir(my $dh, "mnt/big") or die "opendir: $!";
+        my $count = () = readdir($dh);
+        closedir($dh);
+        $count == $opt{entries} + 2 or die "readdir saw $count entries";
+    }, 1..20);
+    record("readdir_$opt{entries}", $lats, $elapsed);
+    unmount();
+}
+
+sub bench_deep_lookup {
+    mount($meta_opts);
+    my $path = "mnt";
+    for my $ii (1..$opt{depth}) {
+        $path .= "/d$ii";
+        mkdir($path) or die "mkdir $path: $!";
+    }
+    $path .= "/leaf";
+    touch(substr($path, 4));
+    record("lookup_depth_$opt{depth}", timed(sub {
+        stat($path) or die "stat: $!";
+    }, 1..5000));
+    unmount();
+}
+
+-x "./$opt{frontend}" or die "build $opt{frontend} first\n";
+system("fusermount -u mnt 2>/dev/null");
+mkdir("mnt");
+unlink($image, $log);
+system("truncate", "-s", "$opt{'image-mb'}M", $image) == 0 or die;
+
+bench_data($_) for @io_sizes;
+bench_small_files();
+bench_readdir();
+bench_deep_lookup();
+
+my $commit = `git rev-parse --short HEAD 2>/dev/null` || "unknown";
+chomp $commit;
+open my $out, ">", $opt{out} or die "$opt{out}: $!";
+print $out JSON::PP->new->canonical->pretty->encode({
+    commit   => $commit,
+    date     => strftime("%Y-%m-%dT%H:%M:%SZ", gmtime),
+    config   => \%opt,
+    results  => \%results,
+});
+close $out;
+say "# results written to $opt{out}";
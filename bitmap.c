@@ -6,6 +6,12 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_PATH 1
+#endif
 
 #include "bitmap.h"
 
@@ -13,12 +19,18 @@
 #define byte_index(n) ((n) / 8)
 #define bit_index(n) ((n) % 8)
 
+#define word_index(n) ((n) / 64)
+#define word_bit(n) ((n) % 64)
+#define ALL_ONES (~(uint64_t) 0)
+
 // Get the given bit from the bitmap.
 // returns true if the bit is one
+// Bits may be read while another thread changes the same byte, so the byte
+// is read and written whole.
 int bitmap_get(void *bm, int i) {
   uint8_t *base = (uint8_t *) bm;
 
-  return (base[byte_index(i)] >> bit_index(i)) & 1;
+  return (__atomic_load_n(&base[byte_index(i)], __ATOMIC_RELAXED) >> bit_index(i)) & 1;
 }
 
 // Set the given bit in the bitmap to the given value.
@@ -28,11 +40,201 @@ void bitmap_put(void *bm, int i, int v) {
   long bit_mask = nth_bit_mask(bit_index(i));
 
   if (v) {
-    base[byte_index(i)] |= bit_mask;
+    __atomic_fetch_or(&base[byte_index(i)], bit_mask, __ATOMIC_RELAXED);
   } else {
     bit_mask = ~bit_mask;
-    base[byte_index(i)] &= bit_mask;
+    __atomic_fetch_and(&base[byte_index(i)], bit_mask, __ATOMIC_RELAXED);
+  }
+}
+
+// Load the 64-bit word holding bits [64 * w, 64 * w + 64).
+// Bit i of the bitmap is bit i % 64 of its word, matching byte_index/bit_index.
+static inline uint64_t load_word(const uint8_t *base, int w) {
+  uint64_t word;
+  memcpy(&word, base + 8 * (int64_t) w, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  return word;
+}
+
+static inline void store_word(uint8_t *base, int w, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word = __builtin_bswap64(word);
+#endif
+  memcpy(base + 8 * (int64_t) w, &word, sizeof(word));
+}
+
+// Mask of bits [lo, hi) within one word, with 0 <= lo <= hi <= 64.
+static inline uint64_t range_mask(int lo, int hi) {
+  uint64_t upper = hi == 64 ? ALL_ONES : ((uint64_t) 1 << hi) - 1;
+  return upper & ~(((uint64_t) 1 << lo) - 1);
+}
+
+// Set or clear count bits starting at start, a word at a time.
+static void bitmap_fill_range(void *bm, int start, int count, int v) {
+  uint8_t *base = (uint8_t *) bm;
+  int end = start + count;
+
+  // bits before the first word boundary and after the last one are done
+  // with a masked read-modify-write; full words in between are stored whole
+  while (start < end) {
+    int w = word_index(start);
+    int lo = word_bit(start);
+    int hi = end - start + lo >= 64 ? 64 : end - start + lo;
+    uint64_t mask = range_mask(lo, hi);
+    if (mask == ALL_ONES) {
+      store_word(base, w, v ? ALL_ONES : 0);
+    } else {
+      uint64_t word = load_word(base, w);
+      store_word(base, w, v ? word | mask : word & ~mask);
+    }
+    start += hi - lo;
+  }
+}
+
+// Set a range of bits to one.
+void bitmap_set_range(void *bm, int start, int count) {
+  bitmap_fill_range(bm, start, count, 1);
+}
+
+// Clear a range of bits to zero.
+void bitmap_clear_range(void *bm, int start, int count) {
+  bitmap_fill_range(bm, start, count, 0);
+}
+
+#ifdef HAVE_AVX2_PATH
+// Skip whole 256-bit groups that are completely full, starting at word w.
+// Returns the first word index that may contain a zero bit (or last_w).
+__attribute__((target("avx2")))
+static int skip_full_avx2(const uint8_t *base, int w, int last_w) {
+  const __m256i ones = _mm256_set1_epi8(-1);
+  while (w + 4 <= last_w) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (base + 8 * (int64_t) w));
+    if (!_mm256_testc_si256(v, ones)) {
+      break;
+    }
+    w += 4;
+  }
+  return w;
+}
+#endif
+
+// Skip words that are completely full, starting at word w.
+static int skip_full(const uint8_t *base, int w, int last_w) {
+#ifdef HAVE_AVX2_PATH
+  static int has_avx2 = -1;
+  if (has_avx2 < 0) {
+    has_avx2 = __builtin_cpu_supports("avx2");
+  }
+  if (has_avx2) {
+    w = skip_full_avx2(base, w, last_w);
+  }
+#endif
+  while (w < last_w && load_word(base, w) == ALL_ONES) {
+    w++;
+  }
+  return w;
+}
+
+// Find the first zero bit in [start, end), or -1.
+static int find_free_in(const uint8_t *base, int start, int end) {
+  if (start >= end) {
+    return -1;
+  }
+  int w = word_index(start);
+  // number of words touched by the range
+  int last_w = word_index(end - 1) + 1;
+
+  // treat the bits before start in the first word as used
+  uint64_t word = load_word(base, w) | range_mask(0, word_bit(start));
+  while (1) {
+    if (word != ALL_ONES) {
+      int i = 64 * w + __builtin_ctzll(~word);
+      return i < end ? i : -1;
+    }
+    w = skip_full(base, w + 1, last_w);
+    if (w >= last_w) {
+      return -1;
+    }
+    word = load_word(base, w);
+  }
+}
+
+// Find the first zero bit at or after the hint, wrapping around once.
+int bitmap_find_free(void *bm, int size, int hint) {
+  const uint8_t *base = (const uint8_t *) bm;
+  if (hint < 0 || hint >= size) {
+    hint = 0;
+  }
+  int i = find_free_in(base, hint, size);
+  if (i < 0) {
+    i = find_free_in(base, 0, hint);
+  }
+  return i;
+}
+
+// Find the first one bit in [start, end), or end.
+static int find_used_in(const uint8_t *base, int start, int end) {
+  if (start >= end) {
+    return end;
+  }
+  int w = word_index(start);
+  int last_w = word_index(end - 1) + 1;
+
+  // treat the bits before start in the first word as free
+  uint64_t word = load_word(base, w) & ~range_mask(0, word_bit(start));
+  while (word == 0) {
+    if (++w >= last_w) {
+      return end;
+    }
+    word = load_word(base, w);
+  }
+  int i = 64 * w + __builtin_ctzll(word);
+  return i < end ? i : end;
+}
+
+// Look at the free runs after the hint, then before it, until one is long
+// enough, remembering the longest.
+int bitmap_find_run(void *bm, int size, int hint, int count, int *len) {
+  const uint8_t *base = (const uint8_t *) bm;
+  if (hint < 0 || hint >= size) {
+    hint = 0;
+  }
+  int from[2] = {hint, 0};
+  int to[2] = {size, hint};
+  int best = -1;
+  *len = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    int i = find_free_in(base, from[pass], to[pass]);
+    while (i >= 0) {
+      int end = find_used_in(base, i, count > to[pass] - i ? to[pass] : i + count);
+      if (end - i > *len) {
+        best = i;
+        *len = end - i;
+        if (*len == count) {
+          return best;
+        }
+      }
+      i = find_free_in(base, end, to[pass]);
+    }
+  }
+  return best;
+}
+
+// Count the one bits among the first size bits.
+int bitmap_count(void *bm, int size) {
+  const uint8_t *base = (const uint8_t *) bm;
+  int count = 0;
+  int w;
+  for (w = 0; w < word_index(size); w++) {
+    count += __builtin_popcountll(load_word(base, w));
+  }
+  if (word_bit(size)) {
+    count += __builtin_popcountll(load_word(base, w) &
+                                  range_mask(0, word_bit(size)));
   }
+  return count;
 }
 
 // Pretty-print the bitmap (with the given no. of bits).
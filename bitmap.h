@@ -3,6 +3,9 @@
  * @author CS3650 staff
  *
  * A bitmap interface.
+ *
+ * The range and search functions work on whole 64-bit words, so the memory
+ * backing a bitmap must be a multiple of 8 bytes (bitmaps live in blocks).
  */
 #ifndef BITMAP_H
 #define BITMAP_H
@@ -26,6 +29,66 @@ int bitmap_get(void *bm, int i);
  */
 void bitmap_put(void *bm, int i, int v);
 
+/**
+ * Set a range of bits in the bitmap to one.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit to set.
+ * @param count Number of bits to set.
+ */
+void bitmap_set_range(void *bm, int start, int count);
+
+/**
+ * Clear a range of bits in the bitmap to zero.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param start Index of the first bit to clear.
+ * @param count Number of bits to clear.
+ */
+void bitmap_clear_range(void *bm, int start, int count);
+
+/**
+ * Find the first zero bit at or after the hint, wrapping around to the
+ * start of the bitmap if nothing is free past the hint.
+ *
+ * The bitmap is scanned a 64-bit word at a time (256 bits at a time when
+ * the CPU supports AVX2), so full regions cost one compare per word.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ * @param hint Bit index to start searching from.
+ *
+ * @return The index of a zero bit, or -1 if every bit is set.
+ */
+int bitmap_find_free(void *bm, int size, int hint);
+
+/**
+ * Find a run of consecutive zero bits, searching like bitmap_find_free.
+ *
+ * The first run of count zero bits at or after the hint is preferred,
+ * wrapping around as before. If there is no run that long, the longest one
+ * is returned instead.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits in the bitmap.
+ * @param hint Bit index to start searching from.
+ * @param count The number of zero bits wanted.
+ * @param len Output for the length of the run found, at most count.
+ *
+ * @return The index of the first bit of the run, or -1 if every bit is set.
+ */
+int bitmap_find_run(void *bm, int size, int hint, int count, int *len);
+
+/**
+ * Count the bits that are set in the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param size The number of bits to count.
+ *
+ * @return The number of one bits among the first size bits.
+ */
+int bitmap_count(void *bm, int size);
+
 /**
  * Pretty-print a bitmap. 
  *
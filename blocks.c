@@ -10,8 +10,10 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -20,22 +22,74 @@
 #include "bitmap.h"
 #include "blocks.h"
 #include "inode.h"
+#include "journal.h"
+#include "log.h"
+#include "uring.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
-const int INODE_COUNT = BLOCK_SIZE / sizeof(inode_t) * NUM_INODE_BLOCKS;
+int BLOCK_COUNT = 0;
+int BLOCK_SIZE = 0;
+int64_t NUFS_SIZE = 0;
+int INODE_COUNT = 0;
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
-// Note: assumes block count is divisible by 8
+int BLOCK_BITMAP_SIZE = 0;
 
 static int blocks_fd = -1;
 static void *blocks_base = 0;
 
+// How blocks get from the image file to memory, see the top of blocks.h.
+typedef struct blocks_backend {
+  const char *name;
+  int open_flags;                                  // extra flags of the descriptor blocks are read and written through
+  void *(*map)();                                  // reserve memory for the whole image
+  int (*load)(const blocks_run_t *runs, int count); // read blocks into memory, NULL when page faults do
+  void (*prefetch)(const blocks_run_t *runs, int count); // get blocks that will be read soon on their way
+} blocks_backend_t;
+
+static void *map_image();
+static void *map_cache();
+static int read_runs(const blocks_run_t *runs, int count);
+static void advise_image(const blocks_run_t *runs, int count);
+static void advise_file(const blocks_run_t *runs, int count);
+static void load_ahead(const blocks_run_t *runs, int count);
+
+static const blocks_backend_t backends[] = {
+  {"mmap", 0, map_image, NULL, advise_image},
+  {"pread", 0, map_cache, read_runs, advise_file},
+  {"direct", O_DIRECT, map_cache, read_runs, load_ahead},
+};
+
+static const blocks_backend_t *backend = &backends[0];
+static int io_fd = -1; // blocks_fd, or the image opened with the backend's flags
+static int use_uring = 0;
+
+// Runs are cut into pieces of at most this many bytes, so a large one keeps
+// several requests in flight at once.
+#define IO_PIECE (256 << 10)
+
+// For backends with load, a bit per block that is in memory, and how many
+// are. Bits are set under the lock of their word's stripe, so a block is
+// only read once even if several threads want it at the same time.
+#define LOAD_LOCKS 64 // one per bit of a word, see lock_stripes
+#define LOAD_WORDS 64 // most words of loaded one batch of reads covers
+static uint64_t *loaded = NULL;
+static long loaded_count = 0;
+static long cache_budget = 0; // in blocks, including the metadata kept in memory for good
+static pthread_mutex_t load_locks[LOAD_LOCKS] = {
+  [0 ... LOAD_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+// Blocks freed since the last commit, still marked as used in the bitmap.
+static uint64_t *freeing = NULL;
+
+// The number of blocks clear in the bitmap, and how many of them are
+// promised by blocks_reserve.
+static int free_count = 0;
+static int reserved = 0;
+
 // Get the number of blocks needed to store the given number of bytes.
-int bytes_to_blocks(int bytes) {
-  int quo = bytes / BLOCK_SIZE;
-  int rem = bytes % BLOCK_SIZE;
+int bytes_to_blocks(int64_t bytes) {
+  int64_t quo = bytes / BLOCK_SIZE;
+  int64_t rem = bytes % BLOCK_SIZE;
   if (rem == 0) {
     return quo;
   } else {
@@ -43,41 +97,572 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Divide rounding up.
+static uint32_t div_up(uint64_t n, uint64_t d) {
+  return (n + d - 1) / d;
+}
+
+// Lay out an image of the given number of blocks in the superblock.
+static void layout(superblock_t *sb, uint32_t block_count) {
+  memset(sb, 0, sizeof(*sb));
+  sb->magic = NUFS_MAGIC;
+  sb->version = NUFS_VERSION;
+  sb->block_size = DEFAULT_BLOCK_SIZE;
+  sb->block_count = block_count;
+
+  // round the inode table up to whole blocks
+  uint32_t inodes_per_block = sb->block_size / sizeof(inode_t);
+  sb->inode_table_blocks =
+      div_up(sb->block_count / BLOCKS_PER_INODE, inodes_per_block);
+  sb->inode_count = sb->inode_table_blocks * inodes_per_block;
+
+  sb->block_bitmap_start = 1;
+  sb->block_bitmap_blocks = div_up(sb->block_count, 8 * sb->block_size);
+  sb->inode_bitmap_start = sb->block_bitmap_start + sb->block_bitmap_blocks;
+  sb->inode_bitmap_blocks = div_up(sb->inode_count, 8 * sb->block_size);
+  sb->inode_table_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+  sb->journal_start = sb->inode_table_start + sb->inode_table_blocks;
+  sb->journal_blocks = sb->block_count / JOURNAL_FRACTION;
+  if (sb->journal_blocks < JOURNAL_MIN_BLOCKS) {
+    sb->journal_blocks = JOURNAL_MIN_BLOCKS;
+  } else if (sb->journal_blocks > JOURNAL_MAX_BLOCKS) {
+    sb->journal_blocks = JOURNAL_MAX_BLOCKS;
+  }
+  sb->data_start = sb->journal_start + sb->journal_blocks;
+}
+
+// Write a fresh superblock for an image of the given size in bytes.
+// The bitmaps are written once the image is mapped.
+static void blocks_format(const char *image_path, int64_t size) {
+  superblock_t sb;
+  layout(&sb, size / DEFAULT_BLOCK_SIZE);
+  if (sb.data_start >= sb.block_count) {
+    // the metadata grows with the image, find the first size it leaves room in
+    superblock_t min;
+    uint32_t count = sb.block_count;
+    do {
+      layout(&min, ++count);
+    } while (min.data_start >= min.block_count);
+    log_error("blocks: %s is too small for an image, it takes at least %u KB",
+              image_path, count * (DEFAULT_BLOCK_SIZE / 1024));
+    exit(1);
+  }
+
+  log_info("+ blocks_format(): %u blocks of %u bytes, %u inodes, %u journal blocks",
+          sb.block_count, sb.block_size, sb.inode_count, sb.journal_blocks);
+
+  // an empty journal, in case the image held something before
+  char zeros[DEFAULT_BLOCK_SIZE];
+  memset(zeros, 0, sizeof(zeros));
+  if (pwrite(blocks_fd, zeros, sizeof(zeros), (int64_t) sb.journal_start * sb.block_size) !=
+          (ssize_t) sizeof(zeros) ||
+      pwrite(blocks_fd, &sb, sizeof(sb), 0) != (ssize_t) sizeof(sb)) {
+    log_error("blocks: formatting %s failed: %s", image_path, strerror(errno));
+    exit(1);
+  }
+}
+
+// Map the image file itself, page faults read it.
+static void *map_image() {
+  return mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, blocks_fd, 0);
+}
+
+// Reserve address space for the image without backing it, blocks are read
+// into it as they are used.
+static void *map_cache() {
+  return mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+}
+
+// Finish a piece of I/O with pread or pwrite, from where it got to.
+static int finish_io(uring_io_t *io, int write) {
+  size_t done = io->res > 0 ? io->res : 0;
+  while (done < io->len) {
+    char *buf = (char *) io->buf + done;
+    ssize_t rv = write ? pwrite(io_fd, buf, io->len - done, io->pos + done)
+                       : pread(io_fd, buf, io->len - done, io->pos + done);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      log_error("blocks: %s the image at %ld failed: %s", write ? "writing" : "reading",
+                (long) (io->pos + done), rv < 0 ? strerror(errno) : "end of file");
+      return -1;
+    }
+    done += rv;
+  }
+  return 0;
+}
+
+// Do a batch of pieces, through io_uring when there is more than one.
+// Whatever the ring doesn't finish is done with pread or pwrite.
+static int do_io(uring_io_t *ios, int count, int write) {
+  if (use_uring && count > 1) {
+    uring_rw(ios, count, write);
+  }
+  int rv = 0;
+  for (int ii = 0; ii < count; ii++) {
+    if (ios[ii].res != (int) ios[ii].len && finish_io(&ios[ii], write) < 0) {
+      rv = -1;
+    }
+  }
+  return rv;
+}
+
+// Read or write runs of blocks between their memory and the image file,
+// URING_ENTRIES pieces at a time.
+static int transfer(const blocks_run_t *runs, int count, int write) {
+  uring_io_t ios[URING_ENTRIES];
+  int nn = 0;
+  int rv = 0;
+  for (int ii = 0; ii < count; ii++) {
+    int64_t pos = (int64_t) runs[ii].bnum * BLOCK_SIZE;
+    int64_t end = pos + (int64_t) runs[ii].count * BLOCK_SIZE;
+    while (pos < end) {
+      size_t len = end - pos < IO_PIECE ? end - pos : IO_PIECE;
+      ios[nn] = (uring_io_t) {(char *) blocks_base + pos, len, pos, -EAGAIN};
+      pos += len;
+      if (++nn == URING_ENTRIES) {
+        rv |= do_io(ios, nn, write);
+        nn = 0;
+      }
+    }
+  }
+  if (nn > 0) {
+    rv |= do_io(ios, nn, write);
+  }
+  return rv;
+}
+
+// Read runs of blocks from the image file into their memory.
+static int read_runs(const blocks_run_t *runs, int count) {
+  return transfer(runs, count, 0);
+}
+
+// Get the bits from lo up to hi of a word, 0 <= lo < hi <= 64.
+static uint64_t bit_range(int lo, int hi) {
+  return (hi - lo == 64 ? ~0ull : (1ull << (hi - lo)) - 1) << lo;
+}
+
+// Lock or unlock the stripes in the mask, in the order of their number so
+// threads locking several at once can't deadlock.
+static void lock_stripes(uint64_t stripes, int lock) {
+  for (; stripes != 0; stripes &= stripes - 1) {
+    pthread_mutex_t *mutex = &load_locks[__builtin_ctzll(stripes)];
+    if (lock) {
+      pthread_mutex_lock(mutex);
+    } else {
+      pthread_mutex_unlock(mutex);
+    }
+  }
+}
+
+// Read the blocks wanted in some words of loaded that aren't in memory yet,
+// as one batch. If any of it can't be read none of it counts as loaded and
+// the next use tries again. Blocks the journal has as changed are never
+// read, the memory is newer than the file.
+// Returns 0 if successful, -1 if reading failed.
+static int load_words(const int *words, const uint64_t *wants, int count) {
+  uint64_t stripes = 0;
+  for (int ii = 0; ii < count; ii++) {
+    stripes |= 1ull << (words[ii] % LOAD_LOCKS);
+  }
+  lock_stripes(stripes, 1);
+  // a word holds at most 32 runs of missing blocks
+  blocks_run_t runs[LOAD_WORDS * 32];
+  uint64_t missing[LOAD_WORDS];
+  int nn = 0;
+  for (int ii = 0; ii < count; ii++) {
+    int ww = words[ii];
+    missing[ii] = wants[ii] & ~__atomic_load_n(&loaded[ww], __ATOMIC_RELAXED);
+    for (uint64_t left = missing[ii]; left != 0; left &= left - 1) {
+      int bnum = ww * 64 + __builtin_ctzll(left);
+      if (journal_is_dirty((char *) blocks_base + (int64_t) BLOCK_SIZE * bnum, BLOCK_SIZE)) {
+        __atomic_or_fetch(&loaded[ww], left & -left, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&loaded_count, 1, __ATOMIC_RELAXED);
+        missing[ii] &= ~(left & -left);
+      }
+    }
+    for (uint64_t left = missing[ii]; left != 0;) {
+      int lo = __builtin_ctzll(left);
+      uint64_t rest = ~left >> lo;
+      int len = rest == 0 ? 64 - lo : __builtin_ctzll(rest);
+      if (nn > 0 && runs[nn - 1].bnum + runs[nn - 1].count == ww * 64 + lo) {
+        runs[nn - 1].count += len;
+      } else {
+        runs[nn++] = (blocks_run_t) {ww * 64 + lo, len};
+      }
+      left &= ~bit_range(lo, lo + len);
+    }
+  }
+  int rv = nn > 0 ? backend->load(runs, nn) : 0;
+  if (rv == 0) {
+    for (int ii = 0; ii < count; ii++) {
+      __atomic_or_fetch(&loaded[words[ii]], missing[ii], __ATOMIC_RELEASE);
+      __atomic_add_fetch(&loaded_count, __builtin_popcountll(missing[ii]), __ATOMIC_RELAXED);
+    }
+  }
+  lock_stripes(stripes, 0);
+  return rv;
+}
+
+// Read the blocks of the runs that aren't in memory yet, gathering the
+// words of loaded they touch into batches of LOAD_WORDS.
+// Returns 0 if successful, -1 if any of the blocks couldn't be read.
+static int load_runs(const blocks_run_t *runs, int count) {
+  int words[LOAD_WORDS];
+  uint64_t wants[LOAD_WORDS];
+  int nn = 0;
+  int rv = 0;
+  for (int ii = 0; ii < count; ii++) {
+    int bnum = runs[ii].bnum;
+    int end = bnum + runs[ii].count;
+    while (bnum < end) {
+      int ww = bnum / 64;
+      int word_end = (ww + 1) * 64 < end ? (ww + 1) * 64 : end;
+      uint64_t want = bit_range(bnum % 64, word_end - ww * 64);
+      bnum = word_end;
+      if ((__atomic_load_n(&loaded[ww], __ATOMIC_ACQUIRE) & want) == want) {
+        continue;
+      }
+      // runs may share a word, it is read once
+      int jj = 0;
+      while (jj < nn && words[jj] != ww) {
+        jj++;
+      }
+      if (jj < nn) {
+        wants[jj] |= want;
+        continue;
+      }
+      words[nn] = ww;
+      wants[nn] = want;
+      if (++nn == LOAD_WORDS) {
+        rv |= load_words(words, wants, nn);
+        nn = 0;
+      }
+    }
+  }
+  if (nn > 0) {
+    rv |= load_words(words, wants, nn);
+  }
+  return rv;
+}
+
+// Load blocks that will be read soon. If it fails the read tries again.
+static void load_ahead(const blocks_run_t *runs, int count) {
+  load_runs(runs, count);
+}
+
+// Pick the backend named by NUFS_BACKEND and open the image for its block
+// I/O. O_DIRECT isn't supported everywhere, e.g. on tmpfs, the page cache
+// is used there after all.
+static void choose_backend(const char *image_path) {
+  const char *name = getenv("NUFS_BACKEND");
+  backend = &backends[0];
+  if (name != NULL) {
+    int found = 0;
+    for (size_t ii = 0; ii < sizeof(backends) / sizeof(backends[0]); ii++) {
+      if (strcmp(name, backends[ii].name) == 0) {
+        backend = &backends[ii];
+        found = 1;
+      }
+    }
+    if (!found) {
+      log_warn("blocks: unknown backend %s, using %s", name, backend->name);
+    }
+  }
+  io_fd = blocks_fd;
+  if (backend->open_flags != 0) {
+    int fd = BLOCK_SIZE % 512 == 0 ? open(image_path, O_RDWR | backend->open_flags) : -1;
+    if (fd < 0) {
+      log_warn("blocks: can't open %s with the %s backend's flags, using the page cache",
+               image_path, backend->name);
+    } else {
+      io_fd = fd;
+    }
+  }
+  const char *mb = getenv("NUFS_CACHE_MB");
+  int64_t budget = mb != NULL && atol(mb) > 0 ? atol(mb) : BLOCKS_CACHE_MB;
+  cache_budget = (budget << 20) / BLOCK_SIZE;
+  use_uring = uring_init(io_fd) == 0;
+  log_info("blocks: %s backend%s", backend->name, use_uring ? " with io_uring" : "");
+}
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
 
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
+  // a new image file gets the default size
+  if (st.st_size == 0) {
+    rv = ftruncate(blocks_fd, DEFAULT_IMAGE_SIZE);
+    assert(rv == 0);
+    st.st_size = DEFAULT_IMAGE_SIZE;
+  }
+
+  // format the image if it was never written to, e.g. it was just created
+  // or sized with truncate. anything else without a superblock may be a
+  // mistyped path, so it is only formatted when NUFS_FORMAT=1 asks for it,
+  // which also replaces an image of another version
+  superblock_t sb;
+  memset(&sb, 0, sizeof(sb));
+  char head[DEFAULT_BLOCK_SIZE];
+  memset(head, 0, sizeof(head));
+  rv = pread(blocks_fd, head, sizeof(head), 0);
+  memcpy(&sb, head, sizeof(sb));
+  int blank = head[0] == 0 && memcmp(head, head + 1, sizeof(head) - 1) == 0;
+  const char *format = getenv("NUFS_FORMAT");
+  int forced = format != NULL && strcmp(format, "1") == 0;
+  int fresh = sb.magic != NUFS_MAGIC || (forced && sb.version != NUFS_VERSION);
+  if (sb.magic != NUFS_MAGIC && !blank && !forced) {
+    log_error("blocks: %s isn't a nufs image, set NUFS_FORMAT=1 to format it", image_path);
+    exit(1);
+  }
+  if (fresh) {
+    blocks_format(image_path, st.st_size);
+    rv = pread(blocks_fd, &sb, sizeof(sb), 0);
+    assert(rv == sizeof(sb));
+  }
+  if (sb.version != NUFS_VERSION) {
+    log_error("blocks: %s is a version %u image, this is version %d; "
+              "set NUFS_FORMAT=1 to format it again", image_path, sb.version, NUFS_VERSION);
+    exit(1);
+  }
+  if (sb.block_size < sizeof(superblock_t) ||
+      (int64_t) sb.block_count * sb.block_size > st.st_size) {
+    log_error("blocks: the superblock of %s doesn't fit the file, %u blocks of %u bytes",
+              image_path, sb.block_count, sb.block_size);
+    exit(1);
+  }
+
+  BLOCK_SIZE = sb.block_size;
+  BLOCK_COUNT = sb.block_count;
+  NUFS_SIZE = (int64_t) BLOCK_COUNT * BLOCK_SIZE;
+  INODE_COUNT = sb.inode_count;
+  BLOCK_BITMAP_SIZE = div_up(BLOCK_COUNT, 8);
+
+  // blocks freed since the last commit, a whole number of 64 bit words
+  freeing = calloc(div_up(BLOCK_COUNT, 64), sizeof(uint64_t));
+  assert(freeing != NULL);
+
+  // finish the last commit before anything reads the image
+  journal_init(blocks_fd, &sb);
+
+  // give the image a place in memory. it is private so that changes only
+  // reach the file through the journal
+  choose_backend(image_path);
+  blocks_base = backend->map();
   assert(blocks_base != MAP_FAILED);
+  if (backend->load != NULL) {
+    loaded = calloc(div_up(BLOCK_COUNT, 64), sizeof(uint64_t));
+    assert(loaded != NULL);
+    // the superblock, bitmaps and inode table stay in memory, they are
+    // used all the time and get_blocks_bitmap() points past block ends
+    blocks_run_t meta = {0, sb.data_start};
+    int rv = load_runs(&meta, 1);
+    assert(rv == 0 && loaded_count == sb.data_start);
+    cache_budget += sb.data_start;
+  }
 
-  // block 0 stores the block bitmap and the inode bitmap
-  void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, 0, 1);
+  if (fresh) {
+    // clear both bitmaps and reserve the metadata blocks
+    int64_t bitmap_bytes =
+        (int64_t) (sb.block_bitmap_blocks + sb.inode_bitmap_blocks) * BLOCK_SIZE;
+    journal_dirty(get_blocks_bitmap(), bitmap_bytes);
+    memset(get_blocks_bitmap(), 0, bitmap_bytes);
+    void *bbm = get_blocks_bitmap();
+    for (uint32_t ii = 0; ii < sb.data_start; ++ii) {
+      bitmap_put(bbm, ii, 1);
+    }
+  }
+  free_count = BLOCK_COUNT - bitmap_count(get_blocks_bitmap(), BLOCK_COUNT);
 }
 
 // Close the disk image.
 void blocks_free() {
   int rv = munmap(blocks_base, NUFS_SIZE);
   assert(rv == 0);
+  uring_stop();
+  if (io_fd != blocks_fd) {
+    close(io_fd);
+  }
+  free(loaded);
+  loaded = NULL;
+  loaded_count = 0;
 }
 
 // Get the given block, returning a pointer to its start.
 void *blocks_get_block(int bnum) {
-  return blocks_base + BLOCK_SIZE * bnum; 
+  return blocks_get_blocks(bnum, 1);
+}
+
+// Get a run of blocks, reading the ones that aren't in memory yet. Callers
+// here have no way to report an error, and going on with blocks that read
+// as zeros would write them home at the next commit, so a failed read stops
+// the file system. The journal has the image as of the last commit.
+void *blocks_get_blocks(int bnum, int count) {
+  blocks_run_t run = {bnum, count};
+  if (loaded != NULL && load_runs(&run, 1) < 0) {
+    log_error("blocks: can't read blocks %d-%d, stopping", bnum, bnum + count - 1);
+    abort();
+  }
+  return blocks_base + (int64_t) BLOCK_SIZE * bnum;
+}
+
+int blocks_load_runs(const blocks_run_t *runs, int count) {
+  return loaded != NULL ? load_runs(runs, count) : 0;
+}
+
+// The address is fixed, only the contents come and go.
+void *blocks_addr(int bnum) {
+  return blocks_base + (int64_t) BLOCK_SIZE * bnum;
+}
+
+// The kernel reads the blocks into the page cache in the background, page
+// faults on them then don't wait for the disk.
+static void advise_image(const blocks_run_t *runs, int count) {
+  long page = sysconf(_SC_PAGESIZE);
+  for (int ii = 0; ii < count; ii++) {
+    int64_t pos = (int64_t) runs[ii].bnum * BLOCK_SIZE;
+    int64_t start = pos / page * page;
+    madvise((char *) blocks_base + start, pos - start + (int64_t) runs[ii].count * BLOCK_SIZE,
+            MADV_WILLNEED);
+  }
+}
+
+// Whether every block of a run is in memory.
+static int run_loaded(int bnum, int count) {
+  int end = bnum + count;
+  while (bnum < end) {
+    int ww = bnum / 64;
+    int word_end = (ww + 1) * 64 < end ? (ww + 1) * 64 : end;
+    uint64_t want = bit_range(bnum % 64, word_end - ww * 64);
+    if ((__atomic_load_n(&loaded[ww], __ATOMIC_RELAXED) & want) != want) {
+      return 0;
+    }
+    bnum = word_end;
+  }
+  return 1;
+}
+
+// Like advise_image, so the pread that loads the blocks finds them in the
+// page cache. The direct backend bypasses it and loads them right away.
+static void advise_file(const blocks_run_t *runs, int count) {
+  for (int ii = 0; ii < count; ii++) {
+    if (!run_loaded(runs[ii].bnum, runs[ii].count)) {
+      posix_fadvise(io_fd, (int64_t) runs[ii].bnum * BLOCK_SIZE,
+                    (int64_t) runs[ii].count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+    }
+  }
+}
+
+void blocks_prefetch(const blocks_run_t *runs, int count) {
+  if (count > 0) {
+    backend->prefetch(runs, count);
+  }
+}
+
+// Get a run of blocks without reading them, they count as in memory now.
+void *blocks_get_new(int bnum, int count) {
+  for (int ii = bnum; loaded != NULL && ii < bnum + count; ii++) {
+    uint64_t bit = 1ull << (ii % 64);
+    if (!(__atomic_fetch_or(&loaded[ii / 64], bit, __ATOMIC_RELEASE) & bit)) {
+      __atomic_add_fetch(&loaded_count, 1, __ATOMIC_RELAXED);
+    }
+  }
+  return blocks_base + (int64_t) BLOCK_SIZE * bnum;
+}
+
+// Write a run of blocks to the image file, through io_fd.
+int blocks_write(int bnum, int count) {
+  blocks_run_t run = {bnum, count};
+  return transfer(&run, 1, 1);
+}
+
+int blocks_write_runs(const blocks_run_t *runs, int count) {
+  return transfer(runs, count, 1);
+}
+
+// Drop the memory of a run of clean blocks. Anonymous memory reads as zeros
+// once it is given back, so blocks of the cache backends must be read again.
+static int drop_run(int bnum, int count) {
+  int pages = BLOCK_SIZE % sysconf(_SC_PAGESIZE) == 0;
+  if (pages) {
+    madvise((char *) blocks_base + (int64_t) BLOCK_SIZE * bnum,
+            (size_t) count * BLOCK_SIZE, MADV_DONTNEED);
+  }
+  if (loaded == NULL) {
+    return pages ? count : 0;
+  }
+  int dropped = 0;
+  for (int ii = bnum; ii < bnum + count; ii++) {
+    uint64_t bit = 1ull << (ii % 64);
+    if (__atomic_fetch_and(&loaded[ii / 64], ~bit, __ATOMIC_RELAXED) & bit) {
+      dropped++;
+    }
+  }
+  __atomic_sub_fetch(&loaded_count, dropped, __ATOMIC_RELAXED);
+  return dropped;
+}
+
+// Drop the clean blocks of a run, a run of them at a time.
+int blocks_drop(int bnum, int count) {
+  int dropped = 0;
+  int end = bnum + count;
+  while (bnum < end) {
+    while (bnum < end && journal_is_dirty(blocks_base + (int64_t) BLOCK_SIZE * bnum, BLOCK_SIZE)) {
+      bnum++;
+    }
+    int first = bnum;
+    while (bnum < end && !journal_is_dirty(blocks_base + (int64_t) BLOCK_SIZE * bnum, BLOCK_SIZE)) {
+      bnum++;
+    }
+    if (bnum > first) {
+      dropped += drop_run(first, bnum - first);
+    }
+  }
+  return dropped;
+}
+
+// A private file mapping reads the blocks back from the page cache, so its
+// memory can go right away. The memory of the cache backends would read as
+// zeros until the blocks are loaded again, which isn't safe under readers;
+// it waits for blocks_drop.
+void blocks_written(int bnum, int count) {
+  if (loaded == NULL) {
+    drop_run(bnum, count);
+  }
+}
+
+// Aim a quarter below the budget, so a commit doesn't have to drop blocks
+// again right after the last one did.
+long blocks_cache_excess() {
+  long count = __atomic_load_n(&loaded_count, __ATOMIC_RELAXED);
+  if (loaded == NULL || count <= cache_budget) {
+    return 0;
+  }
+  return count - cache_budget * 3 / 4;
+}
+
+// Get the number of the block holding the given address.
+int blocks_bnum(const void *addr) {
+  return ((const char *) addr - (const char *) blocks_base) / BLOCK_SIZE;
+}
+
+// Return a pointer to the superblock, which lives at the start of block 0.
+superblock_t *get_superblock() {
+  return (superblock_t *) blocks_base;
 }
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
 void *get_blocks_bitmap() {
-  void* bbm = blocks_get_block(0);
+  void* bbm = blocks_get_block(get_superblock()->block_bitmap_start);
   //printf("get_blocks_bitmap called with bitmap: \n");
   //bitmap_print(bbm, BLOCK_COUNT);
   return bbm;
@@ -85,34 +670,135 @@ void *get_blocks_bitmap() {
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
-  void* ibm = (void*) (block + BLOCK_BITMAP_SIZE);
+  void* ibm = blocks_get_block(get_superblock()->inode_bitmap_start);
   //printf("get_inode_bitmap called with bitmap: \n");
   //bitmap_print(ibm, INODE_COUNT);
-  // The inode bitmap is stored immediately after the block bitmap
   return ibm;
 }
 
+// Where the next allocation without a goal starts searching.
+static int next_block = 0;
+
+// Protects the block bitmap, next_block, freeing, free_count and reserved.
+static pthread_mutex_t block_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Take back a block freed since the last commit, for when the disk is full
+// otherwise. The image on disk may still use it, so whatever is put in it is
+// journaled rather than written in place. It is still marked as used.
+// The caller must hold block_bitmap_lock.
+static int reuse_freed() {
+  for (int ww = 0; ww < (int) div_up(BLOCK_COUNT, 64); ww++) {
+    if (freeing[ww] != 0) {
+      int bnum = ww * 64 + __builtin_ctzll(freeing[ww]);
+      freeing[ww] &= freeing[ww] - 1;
+      journal_dirty(blocks_base + (int64_t) BLOCK_SIZE * bnum, BLOCK_SIZE);
+      return bnum;
+    }
+  }
+  return -1;
+}
+
 // Allocate a new block and return its index.
 int alloc_block() {
+  return alloc_block_near(-1);
+}
+
+// Allocate a new block at or after the goal, falling back to any free block.
+int alloc_block_near(int goal) {
+  int got;
+  return alloc_blocks_near(goal, 1, &got);
+}
+
+// Allocate a run of up to count free blocks, the first one long enough at or
+// after the goal, otherwise the longest there is. Reserved blocks are left
+// alone unless the caller holds the reservation.
+static int alloc_run(int goal, int count, int *got, int from_reserved) {
   void *bbm = get_blocks_bitmap();
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
-    }
+  pthread_mutex_lock(&block_bitmap_lock);
+  if (!from_reserved && count > free_count - reserved) {
+    count = free_count - reserved;
   }
+  // the metadata blocks below data_start are always marked as used
+  int ii = count > 0 ? bitmap_find_run(bbm, BLOCK_COUNT, goal >= 0 ? goal : next_block, count, got) : -1;
+  if (ii < 0) {
+    ii = reuse_freed();
+    *got = ii < 0 ? 0 : 1;
+    pthread_mutex_unlock(&block_bitmap_lock);
+    log_trace("+ alloc_blocks_near(%d, %d) -> %d", goal, count, ii);
+    return ii;
+  }
+  journal_dirty((char *) bbm + ii / 8, (ii + *got - 1) / 8 - ii / 8 + 1);
+  bitmap_set_range(bbm, ii, *got);
+  free_count -= *got;
+  next_block = ii + *got;
+  pthread_mutex_unlock(&block_bitmap_lock);
+  log_trace("+ alloc_blocks_near(%d, %d) -> %d (%d)", goal, count, ii, *got);
+  return ii;
+}
 
-  return -1;
+// Allocate a run of up to count blocks that aren't reserved.
+int alloc_blocks_near(int goal, int count, int *got) {
+  return alloc_run(goal, count, got, 0);
+}
+
+// Allocate a run of up to count blocks the caller reserved.
+int alloc_blocks_reserved(int goal, int count, int *got) {
+  return alloc_run(goal, count, got, 1);
+}
+
+// Promise count free blocks to the caller, if that many aren't promised yet.
+int blocks_reserve(int count) {
+  pthread_mutex_lock(&block_bitmap_lock);
+  int rv = free_count - reserved >= count ? 0 : -1;
+  if (rv == 0) {
+    reserved += count;
+  }
+  pthread_mutex_unlock(&block_bitmap_lock);
+  return rv;
+}
+
+// Give back a promise made by blocks_reserve.
+void blocks_unreserve(int count) {
+  pthread_mutex_lock(&block_bitmap_lock);
+  reserved -= count;
+  pthread_mutex_unlock(&block_bitmap_lock);
 }
 
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
-  void *bbm = get_blocks_bitmap();
-  if (bnum >= 0 && bnum < BLOCK_COUNT) {
-    bitmap_put(bbm, bnum, 0);
+  log_trace("+ free_block(%d)", bnum);
+  free_blocks(bnum, 1);
+}
+
+// Deallocate count blocks starting at bnum, once the next commit starts.
+void free_blocks(int bnum, int count) {
+  log_trace("+ free_blocks(%d, %d)", bnum, count);
+  if (bnum >= 0 && count > 0 && bnum + count <= BLOCK_COUNT) {
+    pthread_mutex_lock(&block_bitmap_lock);
+    bitmap_set_range(freeing, bnum, count);
+    pthread_mutex_unlock(&block_bitmap_lock);
+  }
+}
+
+// Clear the freed blocks in the bitmap, a run of them within a word of freeing at a time.
+void blocks_apply_frees() {
+  char *bbm = get_blocks_bitmap();
+  pthread_mutex_lock(&block_bitmap_lock);
+  for (int ww = 0; ww < (int) div_up(BLOCK_COUNT, 64); ww++) {
+    uint64_t word = freeing[ww];
+    freeing[ww] = 0;
+    while (word != 0) {
+      int lo = __builtin_ctzll(word);
+      uint64_t rest = ~word >> lo;
+      int len = rest == 0 ? 64 - lo : __builtin_ctzll(rest);
+      int bnum = ww * 64 + lo;
+      journal_dirty(bbm + bnum / 8, (bnum + len - 1) / 8 - bnum / 8 + 1);
+      bitmap_clear_range(bbm, bnum, len);
+      free_count += len;
+      journal_forget(bnum, len);
+      word &= len == 64 ? 0 : ~(((1ull << len) - 1) << lo);
+    }
   }
+  pthread_mutex_unlock(&block_bitmap_lock);
 }
@@ -4,18 +4,83 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The whole image has a place in memory, so block data is accessed using
+ * pointers. Changes stay in memory and reach the image file when the journal
+ * commits them (see journal.h). How blocks get into memory depends on the
+ * backend, picked with the NUFS_BACKEND environment variable:
+ *
+ * - mmap (the default) maps the image privately and lets page faults read
+ *   it, through the kernel's page cache.
+ * - pread reserves anonymous memory and reads blocks in with pread the first
+ *   time they are used, a run at a time. The memory of file data beyond
+ *   NUFS_CACHE_MB megabytes (BLOCKS_CACHE_MB by default) is given back at
+ *   commits.
+ * - direct is pread with the image opened O_DIRECT, so block I/O bypasses
+ *   the page cache and the data is only held once, within the budget.
+ *
+ * Blocks are read and written a batch of runs at a time. Batches go through
+ * io_uring when the kernel has it (see uring.h), so they cost one system
+ * call and reach the device together; NUFS_IO_URING=0 makes them use
+ * pread/pwrite, one run after the other.
+ *
+ * Block 0 holds a superblock describing the geometry of the image, so the
+ * same binary can mount images of any size. The geometry globals below are
+ * filled in from the superblock by blocks_init().
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 7
+
+#define DEFAULT_BLOCK_SIZE 4096
+#define DEFAULT_IMAGE_SIZE (1024 * 1024) // used when the image file is empty
+#define BLOCKS_PER_INODE 2 // a new image gets one inode per 2 blocks
+#define JOURNAL_FRACTION 64 // a new image gives 1/64 of its blocks to the journal
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 8192
+#define BLOCKS_CACHE_MB 256 // memory for file data of the pread and direct backends
+
+/**
+ * On-disk superblock, stored at the start of block 0.
+ *
+ * All locations are block numbers. The regions are laid out in the order
+ * superblock, block bitmap, inode bitmap, inode table, journal, data.
+ */
+typedef struct superblock {
+  uint32_t magic;               // NUFS_MAGIC
+  uint32_t version;             // NUFS_VERSION
+  uint32_t block_size;          // bytes per block
+  uint32_t block_count;         // total number of blocks in the image
+  uint32_t inode_count;         // number of inodes in the inode table
+  uint32_t block_bitmap_start;  // first block of the free block bitmap
+  uint32_t block_bitmap_blocks; // length of the block bitmap in blocks
+  uint32_t inode_bitmap_start;  // first block of the free inode bitmap
+  uint32_t inode_bitmap_blocks; // length of the inode bitmap in blocks
+  uint32_t inode_table_start;   // first block of the inode table
+  uint32_t inode_table_blocks;  // length of the inode table in blocks
+  uint32_t journal_start;       // first block of the metadata journal
+  uint32_t journal_blocks;      // length of the journal in blocks
+  uint32_t data_start;          // first block available for file data
+} superblock_t;
+
+extern int BLOCK_COUNT;     // we split the "disk" into blocks
+extern int BLOCK_SIZE;      // default = 4K
+extern int64_t NUFS_SIZE;   // size of the image in bytes
+extern int INODE_COUNT;     // number of inodes in the inode table
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+extern int BLOCK_BITMAP_SIZE; // = BLOCK_COUNT / 8 bytes
+
+/**
+ * A run of consecutive blocks.
+ */
+typedef struct blocks_run {
+  int bnum;  // the first block number
+  int count; // the number of blocks
+} blocks_run_t;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -24,17 +89,21 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
  *
  * @return Number of blocks needed to store the given number of bytes.
  */
-int bytes_to_blocks(int bytes);
+int bytes_to_blocks(int64_t bytes);
 
 /**
  * Load and initialize the given disk image.
  *
+ * If the image does not start with a valid superblock it is formatted:
+ * an empty file becomes a DEFAULT_IMAGE_SIZE image, otherwise the existing
+ * file size (e.g. from `truncate -s 4G`) decides the block count.
+ *
  * @param image_path Path to the disk image file.
  */
 void blocks_init(const char *image_path);
 
 /**
- * Close the disk image.
+ * Close the disk image. Changes that weren't committed are lost.
  */
 void blocks_free();
 
@@ -47,6 +116,141 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a run of consecutive blocks, returning a pointer to the start of the
+ * first one.
+ *
+ * Unlike stepping past the end of blocks_get_block, this makes sure all of
+ * them are in memory. If they can't be read the file system stops, file
+ * data is loaded with blocks_load_runs first so errors can be returned.
+ *
+ * @param bnum The first block number.
+ * @param count The number of blocks.
+ *
+ * @return Pointer to the beginning of the run in memory.
+ */
+void *blocks_get_blocks(int bnum, int count);
+
+/**
+ * Get the address of a block without reading it, e.g. to ask the journal
+ * whether it changed.
+ *
+ * @param bnum The block number.
+ *
+ * @return Pointer to where the block is in memory once it is read.
+ */
+void *blocks_addr(int bnum);
+
+/**
+ * Get a run of blocks that was just allocated and is about to be
+ * overwritten completely, without reading what they held.
+ *
+ * @param bnum The first block number.
+ * @param count The number of blocks.
+ *
+ * @return Pointer to the beginning of the run in memory.
+ */
+void *blocks_get_new(int bnum, int count);
+
+/**
+ * Make sure several runs of blocks are in memory, reading the ones that
+ * aren't together.
+ *
+ * With the pread and direct backends this is one batch of reads rather
+ * than one read per run. With mmap page faults still read the blocks.
+ *
+ * @param runs The runs.
+ * @param count The number of runs.
+ *
+ * @return 0 if successful, -1 if some of the blocks couldn't be read. They
+ *         stay out of memory and the next use tries again.
+ */
+int blocks_load_runs(const blocks_run_t *runs, int count);
+
+/**
+ * Hint that runs of blocks will be read soon, so reading them can start
+ * before anything waits for it.
+ *
+ * mmap and pread have the kernel read the blocks into the page cache in the
+ * background. direct has no page cache to read into and loads them like
+ * blocks_load_runs.
+ *
+ * @param runs The runs.
+ * @param count The number of runs.
+ */
+void blocks_prefetch(const blocks_run_t *runs, int count);
+
+/**
+ * Write a run of blocks from memory to their place in the image file.
+ *
+ * @param bnum The first block number.
+ * @param count The number of blocks.
+ *
+ * @return 0 if successful, -1 if writing failed.
+ */
+int blocks_write(int bnum, int count);
+
+/**
+ * Write several runs of blocks to the image file together, like
+ * blocks_write.
+ *
+ * @param runs The runs.
+ * @param count The number of runs.
+ *
+ * @return 0 if successful, -1 if writing any of them failed.
+ */
+int blocks_write_runs(const blocks_run_t *runs, int count);
+
+/**
+ * Give back the memory of the blocks in a run that have no changes the
+ * image file doesn't have. They are read from the file again when they are
+ * next used.
+ *
+ * Nothing may use the blocks meanwhile, e.g. they are freed, just
+ * allocated, or the caller holds the write lock of the inode using them.
+ *
+ * @param bnum The first block number.
+ * @param count The number of blocks.
+ *
+ * @return The number of blocks whose memory was given back.
+ */
+int blocks_drop(int bnum, int count);
+
+/**
+ * Tell the backend that a run of blocks was just written to the image
+ * file, so it can give back their memory if that is safe while other
+ * threads are reading them.
+ *
+ * @param bnum The first block number.
+ * @param count The number of blocks.
+ */
+void blocks_written(int bnum, int count);
+
+/**
+ * Get how far the memory held for file data is over its budget.
+ *
+ * @return The number of blocks to drop with blocks_drop to get a quarter
+ *         below the budget, or 0 while it is within it. Always 0 for the
+ *         mmap backend, which leaves that to the kernel.
+ */
+long blocks_cache_excess();
+
+/**
+ * Get the number of the block holding an address in the mapped image.
+ *
+ * @param addr Address inside the mapped image.
+ *
+ * @return The block number.
+ */
+int blocks_bnum(const void *addr);
+
+/**
+ * Return a pointer to the superblock of the mounted image.
+ *
+ * @return A pointer to the superblock at the start of block 0.
+ */
+superblock_t *get_superblock();
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -70,11 +274,94 @@ void *get_inode_bitmap();
  */
 int alloc_block();
 
+/**
+ * Allocate a new block as close after the given goal block as possible.
+ *
+ * Used to keep the blocks of a growing file contiguous on disk.
+ *
+ * @param goal The preferred block number, or -1 for no preference.
+ *
+ * @return The index of the newly allocated block, or -1 if the disk is full.
+ */
+int alloc_block_near(int goal);
+
+/**
+ * Allocate a run of consecutive blocks, as close after the given goal block
+ * as possible.
+ *
+ * The first free run of count blocks is taken. When the free space is too
+ * fragmented for that, the longest free run is taken instead, so callers
+ * loop until they have all the blocks they need. Blocks reserved with
+ * blocks_reserve are left alone.
+ *
+ * @param goal The preferred first block number, or -1 for no preference.
+ * @param count The number of blocks wanted.
+ * @param got Output for the number of blocks allocated, 1 to count.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks_near(int goal, int count, int *got);
+
+/**
+ * Allocate a run of blocks like alloc_blocks_near, out of blocks the caller
+ * reserved with blocks_reserve.
+ *
+ * The reservation isn't released, call blocks_unreserve once the blocks are
+ * in use.
+ *
+ * @param goal The preferred first block number, or -1 for no preference.
+ * @param count The number of blocks wanted, at most the number reserved.
+ * @param got Output for the number of blocks allocated, 1 to count.
+ *
+ * @return The index of the first block of the run, or -1 if the disk is full.
+ */
+int alloc_blocks_reserved(int goal, int count, int *got);
+
+/**
+ * Reserve free blocks to be allocated later with alloc_blocks_reserved.
+ *
+ * Other allocations leave reserved blocks alone, so the caller can count on
+ * getting them. Used for data whose place on disk is only picked once it is
+ * written out (delayed allocation).
+ *
+ * @param count The number of blocks to reserve.
+ *
+ * @return 0 if successful, -1 if there aren't that many free blocks left.
+ */
+int blocks_reserve(int count);
+
+/**
+ * Give back blocks reserved with blocks_reserve.
+ *
+ * @param count The number of blocks.
+ */
+void blocks_unreserve(int count);
+
 /**
  * Deallocate the block with the given number.
  *
+ * The block is only handed out again after the next commit (see
+ * blocks_apply_frees).
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Deallocate a run of consecutive blocks, like free_block.
+ *
+ * @param bnum The first block number to deallocate.
+ * @param count The number of blocks to deallocate.
+ */
+void free_blocks(int bnum, int count);
+
+/**
+ * Mark the blocks freed since the last call as free in the block bitmap.
+ *
+ * Called by the journal at the start of a commit, while no transaction is
+ * running. Until then a freed block may still be in use in the image on
+ * disk, so it must not be overwritten with file data.
+ */
+void blocks_apply_frees();
+
 #endif
@@ -0,0 +1,93 @@
+// Directory entry cache
+//
+// A direct mapped table: each (parent, name) pair has exactly one slot it can
+// live in, and a newer entry simply replaces whatever was there.
+
+#include <pthread.h>
+#include <string.h>
+#include "dcache.h"
+#include "directory.h"
+
+#define DCACHE_SLOTS 4096 // must be a power of two
+#define DCACHE_STRIPES 64 // slots equal modulo this share a lock
+
+typedef struct dcache_entry {
+  int parent; // inode number of the directory, -1 for an unused slot
+  int inum;   // inode number the entry refers to
+  uint32_t hash;
+  char name[DIR_NAME_LENGTH];
+} dcache_entry_t;
+
+static dcache_entry_t entries[DCACHE_SLOTS] = {
+  [0 ... DCACHE_SLOTS - 1] = {.parent = -1}
+};
+static pthread_mutex_t locks[DCACHE_STRIPES] = {
+  [0 ... DCACHE_STRIPES - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+static long hit_count = 0;
+static long miss_count = 0;
+
+// get the slot number for the given entry
+static int get_slot(int parent, uint32_t hash) {
+  // mix the parent into the name hash so equal names in different
+  // directories don't fight over one slot
+  uint32_t key = hash ^ ((uint32_t) parent * 2654435761u);
+  return key & (DCACHE_SLOTS - 1);
+}
+
+static pthread_mutex_t *slot_lock(int slot) {
+  return &locks[slot % DCACHE_STRIPES];
+}
+
+// check whether the slot holds the given entry
+static int slot_matches(dcache_entry_t *entry, int parent, const char *name, uint32_t hash) {
+  return entry->parent == parent && entry->hash == hash &&
+         strncmp(entry->name, name, DIR_NAME_LENGTH) == 0;
+}
+
+int dcache_lookup(int parent, const char *name, uint32_t hash) {
+  int slot = get_slot(parent, hash);
+  int inum = -1;
+  pthread_mutex_lock(slot_lock(slot));
+  if (slot_matches(&entries[slot], parent, name, hash)) {
+    inum = entries[slot].inum;
+  }
+  pthread_mutex_unlock(slot_lock(slot));
+  __atomic_add_fetch(inum >= 0 ? &hit_count : &miss_count, 1, __ATOMIC_RELAXED);
+  return inum;
+}
+
+void dcache_insert(int parent, const char *name, uint32_t hash, int inum) {
+  int slot = get_slot(parent, hash);
+  pthread_mutex_lock(slot_lock(slot));
+  dcache_entry_t *entry = &entries[slot];
+  entry->parent = parent;
+  entry->inum = inum;
+  entry->hash = hash;
+  strncpy(entry->name, name, DIR_NAME_LENGTH);
+  pthread_mutex_unlock(slot_lock(slot));
+}
+
+void dcache_remove(int parent, const char *name, uint32_t hash) {
+  int slot = get_slot(parent, hash);
+  pthread_mutex_lock(slot_lock(slot));
+  if (slot_matches(&entries[slot], parent, name, hash)) {
+    entries[slot].parent = -1;
+  }
+  pthread_mutex_unlock(slot_lock(slot));
+}
+
+void dcache_purge_dir(int parent) {
+  for (int i = 0; i < DCACHE_SLOTS; i++) {
+    pthread_mutex_lock(slot_lock(i));
+    if (entries[i].parent == parent) {
+      entries[i].parent = -1;
+    }
+    pthread_mutex_unlock(slot_lock(i));
+  }
+}
+
+void dcache_stats(long *hits, long *misses) {
+  *hits = __atomic_load_n(&hit_count, __ATOMIC_RELAXED);
+  *misses = __atomic_load_n(&miss_count, __ATOMIC_RELAXED);
+}
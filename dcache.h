@@ -0,0 +1,42 @@
+// Directory entry cache.
+//
+// Remembers the results of recent directory lookups in memory, keyed by the
+// parent directory's inode number and the entry name, so resolving a path
+// does not have to go to the directory index for every component.
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+
+// get the cached inode number of the entry with the given name
+// param parent: inode number of the directory
+// param name: the name of the entry
+// param hash: hash of the name from directory_name_hash
+// returns: the inode number, or -1 if the entry is not cached
+int dcache_lookup(int parent, const char *name, uint32_t hash);
+
+// remember the inode number of the entry with the given name
+// param parent: inode number of the directory
+// param name: the name of the entry
+// param hash: hash of the name from directory_name_hash
+// param inum: the inode number the entry refers to
+void dcache_insert(int parent, const char *name, uint32_t hash, int inum);
+
+// forget the entry with the given name, called when it is unlinked or replaced
+// param parent: inode number of the directory
+// param name: the name of the entry
+// param hash: hash of the name from directory_name_hash
+void dcache_remove(int parent, const char *name, uint32_t hash);
+
+// forget every entry cached for the given directory, called when the
+// directory is removed since its inode number may be reused
+// param parent: inode number of the directory
+void dcache_purge_dir(int parent);
+
+// get the hit and miss counters of the cache
+// param hits: output for the number of lookups answered from the cache
+// param misses: output for the number of lookups that were not
+void dcache_stats(long *hits, long *misses);
+
+#endif
@@ -1,102 +1,583 @@
 // directory functions
+//
+// A directory's data is an array of fixed size entry slots. Next to it every
+// directory owns a hidden index inode holding an open addressing hash table
+// that maps name hashes to slots, so lookups, inserts and deletes don't scan
+// the entries.
+//
+// When the table fills up, a new one is started further along in the index
+// and each insert moves a few buckets of the old table over, so no single
+// operation rewrites the whole index. Until the old table is empty lookups
+// look in both. Buckets that were never written read as zeros, which is how
+// an empty bucket is stored, so a new table needs no writes to set it up.
 
 #include <errno.h>
 #include "directory.h"
 #include "bitmap.h"
+#include "dcache.h"
+#include "log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define INDEX_MIN_CAPACITY 16 // buckets in the index of a new directory
+#define INDEX_MOVE_STEP 8     // buckets of the old table each insert moves
+#define BUCKET_EMPTY -1       // bucket never used, ends a probe sequence
+#define BUCKET_DELETED -2     // bucket whose entry was deleted
+
+// the header at the start of a directory index
+typedef struct dir_index_header {
+  uint32_t capacity;     // number of buckets of the table, a power of two
+  uint32_t count;        // buckets holding an entry, in both tables
+  uint32_t used;         // buckets of the table holding an entry or a deleted marker
+  int free_slot;         // first free entry slot in the directory, or -1
+  uint32_t table;        // bucket number where the table starts
+  uint32_t old_capacity; // buckets of the table being moved from, 0 if there is none
+  uint32_t old_table;    // bucket number where that one starts
+  uint32_t moved;        // buckets of the old table moved so far
+} dir_index_header_t;
+
+// a bucket of the directory index, the buckets follow the header. bucket
+// numbers count from the first one after the header, across both tables
+typedef struct dir_bucket {
+  uint32_t hash; // hash of the entry's name
+  int slot;      // slot of the entry in the directory, or BUCKET_EMPTY/BUCKET_DELETED,
+                 // stored plus one
+} dir_bucket_t;
+
+// FNV-1a hash of the entry name
+uint32_t directory_name_hash(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < DIR_NAME_LENGTH && name[i] != 0; i++) {
+    hash ^= (uint8_t) name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void read_header(int index, dir_index_header_t *header) {
+  inode_read(index, (char*) header, sizeof(*header), sizeof(*header), 0);
+}
+
+// the write helpers return 0 if successful, a negative errno otherwise
+static int write_header(int index, dir_index_header_t *header) {
+  int rv = inode_write(index, (char*) header, sizeof(*header), 0);
+  return rv < 0 ? rv : 0;
+}
+
+// buckets past the end of the index read as empty
+static void read_bucket(int index, uint32_t i, dir_bucket_t *bucket) {
+  memset(bucket, 0, sizeof(*bucket));
+  inode_read(index, (char*) bucket, sizeof(*bucket), sizeof(*bucket),
+             sizeof(dir_index_header_t) + (int64_t) i * sizeof(dir_bucket_t));
+  bucket->slot--;
+}
+
+static int write_bucket(int index, uint32_t i, dir_bucket_t *bucket) {
+  dir_bucket_t stored = {bucket->hash, bucket->slot + 1};
+  int rv = inode_write(index, (char*) &stored, sizeof(stored),
+                       sizeof(dir_index_header_t) + (int64_t) i * sizeof(dir_bucket_t));
+  return rv < 0 ? rv : 0;
+}
+
+static void read_entry(int di, int slot, dirent_t *entry) {
+  inode_read(di, (char*) entry, sizeof(dirent_t), sizeof(dirent_t), (int64_t) slot * sizeof(dirent_t));
+}
+
+static int write_entry(int di, int slot, dirent_t *entry) {
+  int rv = inode_write(di, (char*) entry, sizeof(dirent_t), (int64_t) slot * sizeof(dirent_t));
+  return rv < 0 ? rv : 0;
+}
+
+// find the bucket of the entry with the given name in one table
+static int table_find(int di, int index, uint32_t table, uint32_t capacity,
+                      const char *name, uint32_t hash, dirent_t *entry) {
+  uint32_t mask = capacity - 1;
+  uint32_t i = hash & mask;
+  for (uint32_t probes = 0; probes < capacity; probes++, i = (i + 1) & mask) {
+    dir_bucket_t bucket;
+    read_bucket(index, table + i, &bucket);
+    if (bucket.slot == BUCKET_EMPTY) {
+      return -1;
+    }
+    if (bucket.slot >= 0 && bucket.hash == hash) {
+      read_entry(di, bucket.slot, entry);
+      if (strncmp(name, entry->name, DIR_NAME_LENGTH) == 0) {
+        return table + i;
+      }
+    }
+  }
+  return -1;
+}
+
+// find the bucket of the entry with the given name
+// param entry: output for the directory entry if found
+// returns: the bucket number, or -1 if there is no such entry
+static int index_find(int di, const char *name, uint32_t hash, dirent_t *entry) {
+  int index = get_inode(di)->index_inum;
+  dir_index_header_t header;
+  read_header(index, &header);
+  int i = table_find(di, index, header.table, header.capacity, name, hash, entry);
+  if (i < 0 && header.old_capacity > 0) {
+    i = table_find(di, index, header.old_table, header.old_capacity, name, hash, entry);
+  }
+  return i;
+}
+
+// put an entry in the first free bucket of its probe sequence in the table
+// returns: the bucket number if successful, a negative errno otherwise
+static int table_insert(int index, dir_index_header_t *header, uint32_t hash, int slot) {
+  uint32_t mask = header->capacity - 1;
+  uint32_t i = hash & mask;
+  dir_bucket_t bucket;
+  while (1) {
+    read_bucket(index, header->table + i, &bucket);
+    if (bucket.slot < 0) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  if (bucket.slot == BUCKET_EMPTY) {
+    header->used++;
+  }
+  bucket.hash = hash;
+  bucket.slot = slot;
+  int rv = write_bucket(index, header->table + i, &bucket);
+  return rv < 0 ? rv : (int) (header->table + i);
+}
+
+// move the next n buckets of the old table to the table, and drop the old
+// table once all of them are. the caller writes the header
+// returns: 0 if successful, a negative errno otherwise
+static int index_move(int index, dir_index_header_t *header, uint32_t n) {
+  if (header->old_capacity == 0) {
+    return 0;
+  }
+  for (; n > 0 && header->moved < header->old_capacity; n--, header->moved++) {
+    uint32_t i = header->old_table + header->moved;
+    dir_bucket_t bucket;
+    read_bucket(index, i, &bucket);
+    if (bucket.slot < 0) {
+      continue;
+    }
+    // marked deleted rather than empty, so entries further along its probe
+    // sequence are still found until they move too
+    int rv = table_insert(index, header, bucket.hash, bucket.slot);
+    dir_bucket_t deleted = {0, BUCKET_DELETED};
+    if (rv < 0 || (rv = write_bucket(index, i, &deleted)) < 0) {
+      return rv;
+    }
+  }
+  if (header->moved == header->old_capacity) {
+    // give back its blocks, it reads as empty again
+    int64_t start = sizeof(dir_index_header_t) + (int64_t) header->old_table * sizeof(dir_bucket_t);
+    if (inode_punch(get_inode(index), start,
+                    (int64_t) header->old_capacity * sizeof(dir_bucket_t)) < 0) {
+      return -ENOSPC;
+    }
+    header->old_capacity = 0;
+  }
+  return 0;
+}
+
+// start a table with the given number of buckets that the entries move to
+// a few at a time, finishing with the current one first
+// returns: 0 if successful, a negative errno otherwise
+static int index_grow(int index, dir_index_header_t *header, uint32_t capacity) {
+  if (header->old_capacity > 0) {
+    int rv = index_move(index, header, UINT32_MAX);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  // the new table goes before the current one if it fits, which is zeros
+  // since the table that was there was dropped, otherwise after it
+  header->old_table = header->table;
+  header->old_capacity = header->capacity;
+  header->moved = 0;
+  header->table = capacity <= header->table ? 0 : header->table + header->capacity;
+  header->capacity = capacity;
+  header->used = 0;
+  return 0;
+}
+
+// add the entry in the given slot to the index
+// must be called before the entry is written to the slot
+// returns: the bucket number if successful, a negative errno otherwise
+static int index_insert(int di, uint32_t hash, int slot) {
+  int index = get_inode(di)->index_inum;
+  dir_index_header_t header;
+  read_header(index, &header);
+  // keep the table at most 3/4 full, counting deleted markers. it doubles when
+  // the live entries need the room, otherwise a new table of the same size
+  // leaves the markers behind
+  if ((header.used + 1) * 4 > header.capacity * 3) {
+    uint32_t capacity = header.capacity;
+    if ((header.count + 1) * 2 > capacity) {
+      capacity *= 2;
+    }
+    int rv = index_grow(index, &header, capacity);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  int rv = index_move(index, &header, INDEX_MOVE_STEP);
+  if (rv < 0) {
+    return rv;
+  }
+  int i = table_insert(index, &header, hash, slot);
+  if (i < 0) {
+    return i;
+  }
+  header.count++;
+  rv = write_header(index, &header);
+  if (rv < 0) {
+    dir_bucket_t deleted = {0, BUCKET_DELETED};
+    write_bucket(index, i, &deleted);
+    return rv;
+  }
+  return i;
+}
+
+// take back an index_insert whose entry couldn't be written, leaving a
+// deleted marker in its bucket
+static void index_undo(int di, int i) {
+  int index = get_inode(di)->index_inum;
+  dir_index_header_t header;
+  read_header(index, &header);
+  dir_bucket_t bucket = {0, BUCKET_DELETED};
+  if (write_bucket(index, i, &bucket) == 0) {
+    header.count--;
+    write_header(index, &header);
+  }
+}
+
+// create the empty hash index for a new directory
+// returns: 0 if successful, -1 otherwise
+static int index_init(int di) {
+  int index = alloc_inode(0);
+  if (index < 0) {
+    return -1;
+  }
+  inode_dirty(get_inode(index));
+  get_inode(index)->refs = 1;
+  inode_dirty(get_inode(di));
+  get_inode(di)->index_inum = index;
+  dir_index_header_t header = {INDEX_MIN_CAPACITY, 0, 0, -1, 0, 0, 0, 0};
+  return write_header(index, &header) < 0 ? -1 : 0;
+}
+
+// add an entry to a directory whose write lock the caller holds, or which
+// nothing else can reach yet
+// returns: the target inum if successful, a negative errno otherwise
+static int link_locked(int di, const char* name, int target);
+
 int directory_init(int parent) {
-  printf("allocate inode for new directory with parent %d\n", -1);
+  log_trace("allocate inode for new directory with parent %d", -1);
   int inum = alloc_inode(040755);
-  directory_link(inum, ".", inum);
+  if (inum < 0) {
+    return -1;
+  }
+  if (index_init(inum) < 0) {
+    free_inode(inum);
+    return -1;
+  }
+  // nothing can reach the new directory yet, so it needs no lock
+  if (link_locked(inum, ".", inum) < 0) {
+    free_inode(inum);
+    return -1;
+  }
   // decrement the reference counter to compensate for the extra reference of .
+  inode_dirty(get_inode(inum));
   get_inode(inum)->refs--;
   // for non-root directories
-  if (parent >= 0) {
-    directory_link(inum, "..", parent);
+  if (parent >= 0 && link_locked(inum, "..", parent) < 0) {
+    free_inode(inum);
+    return -1;
   }
   return inum;
 }
 
 int directory_put(int di, const char *name, int mode) {
+  dirent_t existing;
+  inode_lock_write(di);
+  if (index_find(di, name, directory_name_hash(name), &existing) >= 0) {
+    inode_unlock(di);
+    return -EEXIST;
+  }
   int inum;
   if (mode & 040000) {
     // if it is a directory
     inum = directory_init(di);
-    get_inode(inum)->mode = mode;
+    if (inum >= 0) {
+      inode_dirty(get_inode(inum));
+      get_inode(inum)->mode = mode;
+    }
   } else {
     inum = alloc_inode(mode);
   }
-  return directory_link(di, name, inum);
+  int rv = inum < 0 ? -ENOSPC : link_locked(di, name, inum);
+  if (inum >= 0 && rv < 0) {
+    // give back the reference the new directory's .. took on this one
+    if (mode & 040000) {
+      inode_dirty(get_inode(di));
+      __atomic_sub_fetch(&get_inode(di)->refs, 1, __ATOMIC_ACQ_REL);
+    }
+    free_inode(inum);
+  }
+  inode_unlock(di);
+  return rv;
 }
 
 // directory inodes store the bits
 int directory_link(int di, const char* name, int target) {
+  inode_lock_write(di);
+  int rv = link_locked(di, name, target);
+  inode_unlock(di);
+  return rv;
+}
+
+static int link_locked(int di, const char* name, int target) {
   // if there is a directory of the same name return error directory exists
-  if (directory_lookup(di, name) >= 0) {
+  dirent_t entry;
+  uint32_t hash = directory_name_hash(name);
+  if (index_find(di, name, hash, &entry) >= 0) {
     return -EEXIST;
   }
-  printf("link name %s to inode %d in directory %d\n", name, target, di);
+  log_trace("link name %s to inode %d in directory %d", name, target, di);
   void* bmap = get_inode_bitmap();
   if (bitmap_get(bmap, target)) {
-    // get pointer to new directory entry
-    dirent_t* entry = (dirent_t*) malloc(sizeof(dirent_t));
-    strncpy(entry->name, name, 128);
-    entry->inum = target;
-    inode_write(di, (char*) entry, sizeof(dirent_t), get_inode(di)->size);
-    get_inode(target)->refs++;
-    free(entry);
+    int index = get_inode(di)->index_inum;
+    memset(&entry, 0, sizeof(entry));
+    // callers check the length, the zeroed entry ends the name
+    memcpy(entry.name, name, strnlen(name, DIR_NAME_LENGTH - 1));
+    entry.inum = target;
+    entry.hash = hash;
+    entry.next_free = -1;
+
+    // reuse a free slot if there is one, otherwise append
+    dir_index_header_t header;
+    read_header(index, &header);
+    int slot = get_inode(di)->size / sizeof(dirent_t);
+    dirent_t free_entry;
+    if (header.free_slot >= 0) {
+      slot = header.free_slot;
+      read_entry(di, slot, &free_entry);
+    }
+
+    int i = index_insert(di, entry.hash, slot);
+    if (i < 0) {
+      return i;
+    }
+    // appending a slot grows the directory, which may run out of space
+    int rv = write_entry(di, slot, &entry);
+    if (rv < 0) {
+      index_undo(di, i);
+      return rv;
+    }
+    if (slot == header.free_slot) {
+      // the insert rewrote the header, so reread it to pop the slot
+      read_header(index, &header);
+      header.free_slot = free_entry.next_free;
+      rv = write_header(index, &header);
+      if (rv < 0) {
+        write_entry(di, slot, &free_entry);
+        index_undo(di, i);
+        return rv;
+      }
+    }
+    // the target's lock isn't held, it may be unlinked elsewhere at the same time
+    inode_dirty(get_inode(target));
+    __atomic_add_fetch(&get_inode(target)->refs, 1, __ATOMIC_ACQ_REL);
     return target;
   }
   return -ENOENT;
 }
 
+// look the name up in the index, caching what is found
+// the caller holds the directory's lock
+static int lookup_locked(int dir_inum, const char *name, uint32_t hash) {
+  dirent_t entry;
+  if (index_find(dir_inum, name, hash, &entry) >= 0) {
+    dcache_insert(dir_inum, name, hash, entry.inum);
+    return entry.inum;
+  }
+  return -ENOENT;
+}
+
 // Get the inum of the file or directory with the given name in the given inode
 // empty string returns parent inum
 int directory_lookup(int dir_inum, const char *name) {
-  printf("directory_lookup of %s\n", name);
-  inode_t* di = get_inode(dir_inum);
-  dirent_t *dirs = blocks_get_block(di->block[0]);
-  
+  log_trace("directory_lookup of %s", name);
+
   if (strnlen(name, 4) == 0) {
     return dir_inum;
   }
 
-  for (int i = 0; i < di->size / sizeof(dirent_t); i++) {
-    if (strncmp(name, dirs[i].name, 128) == 0) {
-      return dirs[i].inum;
+  // only directories have an index to look names up in
+  if (get_inode(dir_inum)->index_inum < 0) {
+    return -ENOTDIR;
+  }
+  // entries are dropped from the cache under the directory's write lock, so
+  // a hit is as good as a lookup in the index
+  uint32_t hash = directory_name_hash(name);
+  int inum = dcache_lookup(dir_inum, name, hash);
+  if (inum >= 0) {
+    return inum;
+  }
+  inode_lock_read(dir_inum);
+  inum = lookup_locked(dir_inum, name, hash);
+  inode_unlock(dir_inum);
+  return inum;
+}
+
+int directory_lookup_pin(int dir_inum, const char *name) {
+  if (get_inode(dir_inum)->index_inum < 0) {
+    return -ENOTDIR;
+  }
+  // the directory's lock keeps the entry from being deleted, and the inode
+  // freed, before the pin is taken
+  inode_lock_read(dir_inum);
+  int inum = lookup_locked(dir_inum, name, directory_name_hash(name));
+  if (inum >= 0) {
+    inode_pin(inum, 1);
+  }
+  inode_unlock(dir_inum);
+  return inum;
+}
+
+// remove the entry from the directory, whose lock the caller holds, without
+// dropping the reference it held
+// returns: the inode number of the entry, or a negative errno
+static int delete_locked(int di, const char *name) {
+  int index = get_inode(di)->index_inum;
+  dirent_t entry;
+  uint32_t hash = directory_name_hash(name);
+  int i = index_find(di, name, hash, &entry);
+  if (i < 0) {
+    return -ENOENT;
+  }
+  int target = entry.inum;
+  dcache_remove(di, name, hash);
+  // the directory's inode number may be reused, so its cached children go too
+  if (get_inode(target)->mode & 040000) {
+    dcache_purge_dir(target);
+  }
+
+  dir_index_header_t header;
+  read_header(index, &header);
+  dir_bucket_t bucket;
+  read_bucket(index, i, &bucket);
+  dir_bucket_t old_bucket = bucket;
+  int slot = bucket.slot;
+  bucket.slot = BUCKET_DELETED;
+  int rv = write_bucket(index, i, &bucket);
+  if (rv < 0) {
+    return rv;
+  }
+
+  // the slot becomes the head of the free list, the other entries stay put.
+  // if that can't be written the entry is put back the way it was
+  dirent_t old_entry = entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.inum = -1;
+  entry.next_free = header.free_slot;
+  rv = write_entry(di, slot, &entry);
+  if (rv == 0) {
+    header.free_slot = slot;
+    header.count--;
+    rv = write_header(index, &header);
+    if (rv < 0) {
+      write_entry(di, slot, &old_entry);
     }
   }
+  if (rv < 0) {
+    write_bucket(index, i, &old_bucket);
+    return rv;
+  }
+  return target;
+}
 
-  return -ENOENT;
+// drop the reference of a deleted entry outside the directory's lock,
+// waiting for anyone still reading or writing the target
+static void put_target(int target) {
+  inode_lock_write(target);
+  free_inode(target);
+  inode_unlock(target);
 }
 
 // Delete the directory in the given inode with the given name
 int directory_delete(int di, const char *name) {
-  inode_t *dinode = get_inode(di);
-  dirent_t* dirs = (dirent_t*) malloc(sizeof(dirent_t));
-  for (int i = 0; i < dinode->size; i+= sizeof(dirent_t)) {
-    inode_read(di, (char*) dirs, sizeof(dirent_t), sizeof(dirent_t), i);
-    // if the directory entry is the one to delete
-    if (strncmp(name, dirs->name, 128) == 0) {
-      free_inode(dirs->inum);
-      // move the following entries forwards by one spoti
-      int remaining_space = dinode->size - i;
-      char* following_entries = malloc(remaining_space);
-      // read from the next dirent into buffer
-      inode_read(di, (char*) following_entries, remaining_space, remaining_space, i + sizeof(dirent_t));
-      // write the buffer back in with the offset one less
-      inode_write(di, (char*) following_entries, remaining_space, i);
-      shrink_inode(dinode, sizeof(dirent_t));
-      free(following_entries);
-      free(dirs);
-      return 0;
-    }
-  }
-  free(dirs);
-  return -ENOENT; 
+  inode_lock_write(di);
+  int target = delete_locked(di, name);
+  inode_unlock(di);
+  if (target < 0) {
+    return target;
+  }
+  put_target(target);
+  return 0;
+}
+
+// The child's lock keeps entries from being added to it while it is checked
+// and unlinked. Its .. goes first, giving back the reference it held on the
+// parent, which has a name of its own (or is the root) and is never freed by it.
+int directory_rmdir(int di, const char *name) {
+  inode_lock_write(di);
+  dirent_t entry;
+  if (index_find(di, name, directory_name_hash(name), &entry) < 0) {
+    inode_unlock(di);
+    return -ENOENT;
+  }
+  int target = entry.inum;
+  if (!(get_inode(target)->mode & 040000)) {
+    inode_unlock(di);
+    return -ENOTDIR;
+  }
+  inode_lock_write(target);
+  dir_index_header_t header;
+  read_header(get_inode(target)->index_inum, &header);
+  // . and .. are all an empty directory holds
+  int rv = header.count > 2 ? -ENOTEMPTY : delete_locked(target, "..");
+  if (rv >= 0) {
+    inode_dirty(get_inode(di));
+    __atomic_sub_fetch(&get_inode(di)->refs, 1, __ATOMIC_ACQ_REL);
+    rv = delete_locked(di, name);
+    if (rv < 0) {
+      link_locked(target, "..", di);
+    }
+  }
+  inode_unlock(target);
+  inode_unlock(di);
+  if (rv < 0) {
+    return rv;
+  }
+  put_target(target);
+  return 0;
+}
+
+// Only the entry's inode number changes, the name and its place in the index stay
+int directory_set_parent(int di, int parent) {
+  inode_lock_write(di);
+  dirent_t entry;
+  int i = index_find(di, "..", directory_name_hash(".."), &entry);
+  if (i < 0) {
+    inode_unlock(di);
+    return -ENOENT;
+  }
+  int old_parent = entry.inum;
+  dir_bucket_t bucket;
+  read_bucket(get_inode(di)->index_inum, i, &bucket);
+  entry.inum = parent;
+  int rv = write_entry(di, bucket.slot, &entry);
+  if (rv == 0) {
+    dcache_remove(di, "..", directory_name_hash(".."));
+    inode_dirty(get_inode(parent));
+    __atomic_add_fetch(&get_inode(parent)->refs, 1, __ATOMIC_ACQ_REL);
+    inode_dirty(get_inode(old_parent));
+    __atomic_sub_fetch(&get_inode(old_parent)->refs, 1, __ATOMIC_ACQ_REL);
+  }
+  inode_unlock(di);
+  return rv;
 }
 
 // Get a linked list of the directories on the path
@@ -104,32 +585,41 @@ slist_t *directory_list(const char *path) {
   return s_explode(path, '/');
 }
 
-// print the directory element names with 2 spaces between them 
+// print the directory element names with 2 spaces between them
 void print_directory(int dd) {
   int size = get_inode(dd)->size;
-  char* entry = (char*) malloc(sizeof(dirent_t));
+  dirent_t entry;
   for (int i = 0; i < size; i += sizeof(dirent_t)) {
-    inode_read(dd, entry, sizeof(dirent_t), sizeof(dirent_t), i);
-    printf("%s  ", ((dirent_t*)entry)->name);
+    inode_read(dd, (char*) &entry, sizeof(dirent_t), sizeof(dirent_t), i);
+    if (entry.inum >= 0) {
+      printf("%s  ", entry.name);
+    }
   }
-  free(entry);
 }
 
 // fill fuse directory
-void directory_readdir(int dir_inum, void* buf, fuse_fill_dir_t filler, off_t offset) {
+// offsets are slot numbers, which don't change while an entry exists
+void directory_readdir(int dir_inum, void* buf, dir_filler_t filler, off_t offset) {
   inode_t* di = get_inode(dir_inum);
-  dirent_t* entry = (dirent_t*) malloc(sizeof(dirent_t));
-  struct stat* statbuf = malloc(sizeof(struct stat));
-  for (int i = offset; i < di->size / sizeof(dirent_t); i++) {
-    inode_read(dir_inum, (char*) entry, sizeof(dirent_t), sizeof(dirent_t), i * sizeof(dirent_t));
-    inode_t* node = get_inode(entry->inum);
-    statbuf->st_mode = node->mode;
-    statbuf->st_size = node->size;
-    statbuf->st_nlink = node->refs;
-    statbuf->st_atim = node->access_time;
-    statbuf->st_mtim = node->modification_time;
-    filler(buf, entry->name, statbuf , i + 1);
-  }
-  free(entry);
-  free(statbuf);
+  dirent_t entry;
+  struct stat statbuf;
+  memset(&statbuf, 0, sizeof(statbuf));
+  inode_lock_read(dir_inum);
+  for (int i = offset; i < (int) (di->size / sizeof(dirent_t)); i++) {
+    read_entry(dir_inum, i, &entry);
+    if (entry.inum < 0) {
+      continue;
+    }
+    inode_t* node = get_inode(entry.inum);
+    statbuf.st_ino = entry.inum;
+    statbuf.st_mode = node->mode;
+    statbuf.st_size = node->size;
+    statbuf.st_nlink = node->refs;
+    statbuf.st_atim = node->access_time;
+    statbuf.st_mtim = node->modification_time;
+    if (filler(buf, entry.name, &statbuf, i + 1)) {
+      break;
+    }
+  }
+  inode_unlock(dir_inum);
 }
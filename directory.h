@@ -10,26 +10,43 @@
 
 #include "inode.h"
 #include "slist.h"
-#include <fuse.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 // directory entry
+// entries stay in the slot they were created in, so readdir order is stable.
+// deleted entries become free slots that are reused by later entries
 typedef struct direntry {
-  char name[DIR_NAME_LENGTH]; // name of the entry, up to 48 characters
-  int inum; // inode number of the directory entry
-  char _reserved[12]; // space reserved to allow adding more metadata without changing struct size
+  char name[DIR_NAME_LENGTH]; // name of the entry, up to 128 characters
+  int inum; // inode number of the directory entry, -1 for a free slot
+  uint32_t hash; // hash of the name, kept for rebuilding the directory index
+  int next_free; // for a free slot, the next free slot or -1
+  char _reserved[4]; // space reserved to allow adding more metadata without changing struct size
 } dirent_t;
 
+// hash an entry name, as used by the directory index and the dentry cache
+// param name: the entry name
+// returns: the FNV-1a hash of the name
+uint32_t directory_name_hash(const char *name);
+
 // initialize a new directory with . and .. entries
 // param parent: the inode of the parent directory. If parent is -1 the directory be root
 // returns: the inode number of the directory
 int directory_init(int parent);
 
 // get the inum of the file or directory with the given name in the given inode
+// the name is found through the directory's hash index in O(1) expected time
 // param di: pointer to the directory inode
 // param name: the name of the file or directory
-// returns: the inum if found, otherwise -1
+// returns: the inum if found, -ENOENT if it isn't, -ENOTDIR if di is not a directory
 int directory_lookup(int dir_inum, const char *name);
 
+// look up the name like directory_lookup, and pin the inode it names (see
+// inode_pin) before the entry can be removed
+// returns: the inum if found, otherwise a negative errno
+int directory_lookup_pin(int dir_inum, const char *name);
+
 // add a new directory entry with the given name in the given directory
 // param di: inode number of the directory
 // param name: the name of the file to add
@@ -49,6 +66,20 @@ int directory_link(int di, const char *name, int target);
 // param name: the directory to delete
 int directory_delete(int di, const char *name);
 
+// delete the empty directory with the given name from the given directory
+// param di: the directory inode
+// param name: the name of the directory to delete
+// returns: 0 if successful, -ENOTEMPTY if it has entries, -ENOTDIR if it
+// isn't a directory, another negative errno otherwise
+int directory_rmdir(int di, const char *name);
+
+// point the .. entry of a directory that moved at its new parent, moving the
+// reference it holds from the old parent to the new one
+// param di: the directory inode
+// param parent: the inode of the new parent
+// returns: 0 if successful, a negative errno otherwise
+int directory_set_parent(int di, int parent);
+
 // get a linked list of the directories on the path.
 // returns: a linked list of strings containing the directories on the path
 slist_t *directory_list(const char *path);
@@ -56,7 +87,12 @@ slist_t *directory_list(const char *path);
 // print the directory
 void print_directory(int dd);
 
+// called by directory_readdir for each entry, with the offset to continue
+// listing from after it. it has the signature of FUSE's fuse_fill_dir_t
+// returns: nonzero to stop the listing
+typedef int (*dir_filler_t)(void *buf, const char *name, const struct stat *st, off_t offset);
+
 // call the filler function on each entry in the directory
-void directory_readdir(int dir_inum, void* buf, fuse_fill_dir_t filler, off_t offset);
+void directory_readdir(int dir_inum, void* buf, dir_filler_t filler, off_t offset);
 
 #endif
@@ -0,0 +1,425 @@
+// Extent tree functions
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "extent.h"
+#include "journal.h"
+
+// deepest tree supported, far more than 2^31 file blocks need
+#define MAX_DEPTH 5
+// number of entries that fit in a tree block after its header
+#define NODE_MAX ((int) ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_t)))
+// number of inodes whose last used leaf is remembered
+#define CURSOR_SLOTS 1024
+
+// a node of the tree, either the root in the inode or a tree block
+typedef struct tree_node {
+  int bnum;          // block number, or -1 for the root in the inode
+  int *count;        // number of entries in use
+  int depth;         // 0 for a leaf
+  int max;           // capacity of the node
+  extent_t *entries; // the entries, sorted by file_bnum
+} tree_node_t;
+
+// the nodes visited on the way from the root to a leaf
+typedef struct tree_path {
+  int len;                    // number of levels, the leaf is at len - 1
+  int bnum[MAX_DEPTH + 1];    // block of each node, -1 for the root
+  int idx[MAX_DEPTH + 1];     // entry followed at each level, -1 if before the first
+  int lo;                     // first file block the leaf is responsible for
+  int hi;                     // file block after the last one the leaf is responsible for
+} tree_path_t;
+
+// the leaf a lookup last ended in, and the range of file blocks it covers
+// readers of the same inode, and inodes sharing a slot, update it concurrently,
+// so it is only copied in and out under its spinlock
+typedef struct extent_cursor {
+  inode_t *node;
+  int leaf;
+  int lo;
+  int hi;
+  char lock;
+} extent_cursor_t;
+
+static extent_cursor_t cursors[CURSOR_SLOTS];
+
+// get the cursor slot of the inode
+static extent_cursor_t *get_cursor(inode_t *node) {
+  return &cursors[((uintptr_t) node / sizeof(inode_t)) % CURSOR_SLOTS];
+}
+
+static void cursor_lock(extent_cursor_t *cursor) {
+  while (__atomic_test_and_set(&cursor->lock, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+static void cursor_unlock(extent_cursor_t *cursor) {
+  __atomic_clear(&cursor->lock, __ATOMIC_RELEASE);
+}
+
+// forget the cached leaf of the inode after the shape of its tree changed
+static void invalidate_cursor(inode_t *node) {
+  extent_cursor_t *cursor = get_cursor(node);
+  cursor_lock(cursor);
+  if (cursor->node == node) {
+    cursor->node = NULL;
+  }
+  cursor_unlock(cursor);
+}
+
+// get the root node (bnum -1) or the tree block with the given number
+static tree_node_t get_node(inode_t *node, int bnum) {
+  tree_node_t n;
+  n.bnum = bnum;
+  if (bnum < 0) {
+    n.count = &node->extent_count;
+    n.depth = node->extent_depth;
+    n.max = NUM_INODE_EXTENTS;
+    n.entries = node->extent;
+  } else {
+    extent_header_t *header = blocks_get_block(bnum);
+    n.count = &header->count;
+    n.depth = header->depth;
+    n.max = NODE_MAX;
+    n.entries = (extent_t *) (header + 1);
+  }
+  return n;
+}
+
+// mark the node as changed, before changing it
+static void dirty_node(inode_t *node, tree_node_t *n) {
+  if (n->bnum < 0) {
+    journal_dirty(node, sizeof(inode_t));
+  } else {
+    journal_dirty(blocks_get_block(n->bnum), BLOCK_SIZE);
+  }
+}
+
+// get the index of the last entry starting at or before file_bnum, or -1
+static int search(extent_t *entries, int count, int file_bnum) {
+  int lo = 0;
+  int hi = count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (entries[mid].file_bnum <= file_bnum) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+// walk from the root down to the leaf responsible for file_bnum
+static void find_path(inode_t *node, int file_bnum, tree_path_t *path) {
+  int bnum = -1;
+  path->len = 0;
+  path->lo = INT_MIN;
+  path->hi = INT_MAX;
+  while (1) {
+    tree_node_t n = get_node(node, bnum);
+    int idx = search(n.entries, *n.count, file_bnum);
+    path->bnum[path->len] = bnum;
+    path->idx[path->len] = idx;
+    path->len++;
+    if (n.depth == 0) {
+      return;
+    }
+    // index keys are lower bounds for their subtree, anything before the
+    // first key belongs to the first child
+    if (idx < 0) {
+      idx = 0;
+      path->idx[path->len - 1] = 0;
+    } else if (idx > 0) {
+      path->lo = n.entries[idx].file_bnum;
+    }
+    if (idx + 1 < *n.count) {
+      path->hi = n.entries[idx + 1].file_bnum;
+    }
+    bnum = n.entries[idx].start;
+  }
+}
+
+// get the first file block of the first extent after the leaf entry the path ends at
+// returns: the file block, or INT_MAX if there is no later extent
+static int next_start(inode_t *node, tree_path_t *path) {
+  for (int level = path->len - 1; level >= 0; level--) {
+    tree_node_t n = get_node(node, path->bnum[level]);
+    int idx = path->idx[level] + 1;
+    if (idx < *n.count) {
+      // descend to the leftmost leaf of the next subtree
+      extent_t *entry = &n.entries[idx];
+      while (n.depth > 0) {
+        n = get_node(node, entry->start);
+        entry = &n.entries[0];
+      }
+      return entry->file_bnum;
+    }
+  }
+  return INT_MAX;
+}
+
+// fill ext with the extent at idx of the leaf if it holds file_bnum
+// returns: 1 if it does, 0 if not
+static int leaf_covers(tree_node_t *leaf, int idx, int file_bnum, extent_t *ext) {
+  if (idx >= 0 && file_bnum < leaf->entries[idx].file_bnum + leaf->entries[idx].length) {
+    *ext = leaf->entries[idx];
+    return 1;
+  }
+  return 0;
+}
+
+// look up file_bnum, optionally going through the inode's cached leaf
+static int lookup(inode_t *node, int file_bnum, extent_t *ext, int use_cursor) {
+  extent_cursor_t *cursor = get_cursor(node);
+  extent_cursor_t cached = {NULL};
+  if (use_cursor) {
+    cursor_lock(cursor);
+    cached = *cursor;
+    cursor_unlock(cursor);
+  }
+  tree_node_t leaf;
+  int idx;
+  if (cached.node == node && cached.lo <= file_bnum && file_bnum < cached.hi) {
+    leaf = get_node(node, cached.leaf);
+    idx = search(leaf.entries, *leaf.count, file_bnum);
+    if (leaf_covers(&leaf, idx, file_bnum, ext)) {
+      return 1;
+    }
+    if (idx + 1 < *leaf.count) {
+      ext->file_bnum = file_bnum;
+      ext->start = -1;
+      ext->length = leaf.entries[idx + 1].file_bnum - file_bnum;
+      return 0;
+    }
+    // the next extent is in a later leaf, which takes the full walk
+  }
+
+  tree_path_t path;
+  find_path(node, file_bnum, &path);
+  leaf = get_node(node, path.bnum[path.len - 1]);
+  idx = path.idx[path.len - 1];
+  if (use_cursor && leaf.bnum >= 0) {
+    cursor_lock(cursor);
+    cursor->node = node;
+    cursor->leaf = leaf.bnum;
+    cursor->lo = path.lo;
+    cursor->hi = path.hi;
+    cursor_unlock(cursor);
+  }
+  if (leaf_covers(&leaf, idx, file_bnum, ext)) {
+    return 1;
+  }
+  ext->file_bnum = file_bnum;
+  ext->start = -1;
+  ext->length = next_start(node, &path) - file_bnum;
+  return 0;
+}
+
+// find the extent holding the given file block
+int extent_lookup(inode_t *node, int file_bnum, extent_t *ext) {
+  return lookup(node, file_bnum, ext, 1);
+}
+
+// get the last extent of the file by following the last entry at each level
+int extent_last(inode_t *node, extent_t *ext) {
+  tree_node_t n = get_node(node, -1);
+  while (*n.count > 0) {
+    extent_t *entry = &n.entries[*n.count - 1];
+    if (n.depth == 0) {
+      *ext = *entry;
+      return 1;
+    }
+    n = get_node(node, entry->start);
+  }
+  return 0;
+}
+
+// make room in the full node at the given level of the path, either by
+// splitting it or, for the root, by pushing its entries down a level
+// the path is stale afterwards
+// returns: 0 if successful, -1 if a block could not be allocated
+static int make_room(inode_t *node, tree_path_t *path, int level) {
+  tree_node_t n = get_node(node, path->bnum[level]);
+  if (level == 0) {
+    if (node->extent_depth == MAX_DEPTH) {
+      return -1;
+    }
+    int bnum = alloc_block();
+    if (bnum < 0) {
+      return -1;
+    }
+    extent_header_t *header = blocks_get_new(bnum, 1);
+    journal_dirty(header, BLOCK_SIZE);
+    header->count = *n.count;
+    header->depth = n.depth;
+    memcpy(header + 1, n.entries, *n.count * sizeof(extent_t));
+    dirty_node(node, &n);
+    node->extent[0].start = bnum;
+    node->extent[0].length = 0;
+    node->extent_count = 1;
+    node->extent_depth++;
+    return 0;
+  }
+
+  tree_node_t parent = get_node(node, path->bnum[level - 1]);
+  if (*parent.count == parent.max) {
+    return make_room(node, path, level - 1);
+  }
+  // move the upper half of the entries into a new block
+  int bnum = alloc_block();
+  if (bnum < 0) {
+    return -1;
+  }
+  extent_header_t *header = blocks_get_new(bnum, 1);
+  journal_dirty(header, BLOCK_SIZE);
+  dirty_node(node, &n);
+  dirty_node(node, &parent);
+  extent_t *moved = (extent_t *) (header + 1);
+  int keep = *n.count / 2;
+  header->count = *n.count - keep;
+  header->depth = n.depth;
+  memcpy(moved, &n.entries[keep], header->count * sizeof(extent_t));
+  *n.count = keep;
+
+  // and index it right after the node in the parent
+  int idx = path->idx[level - 1] + 1;
+  memmove(&parent.entries[idx + 1], &parent.entries[idx], (*parent.count - idx) * sizeof(extent_t));
+  parent.entries[idx].file_bnum = moved[0].file_bnum;
+  parent.entries[idx].start = bnum;
+  parent.entries[idx].length = 0;
+  (*parent.count)++;
+  return 0;
+}
+
+// remove the entry at idx of the node at the given level, freeing tree
+// blocks that become empty
+static void remove_entry(inode_t *node, tree_path_t *path, int level, int idx) {
+  tree_node_t n = get_node(node, path->bnum[level]);
+  dirty_node(node, &n);
+  memmove(&n.entries[idx], &n.entries[idx + 1], (*n.count - idx - 1) * sizeof(extent_t));
+  (*n.count)--;
+  if (*n.count > 0) {
+    return;
+  }
+  if (level > 0) {
+    free_block(n.bnum);
+    remove_entry(node, path, level - 1, path->idx[level - 1]);
+  } else {
+    node->extent_depth = 0;
+  }
+}
+
+// pull the only child of the root back into the inode while it fits
+static void collapse_root(inode_t *node) {
+  while (node->extent_depth > 0 && node->extent_count == 1) {
+    int bnum = node->extent[0].start;
+    extent_header_t *header = blocks_get_block(bnum);
+    if (header->count > NUM_INODE_EXTENTS) {
+      return;
+    }
+    journal_dirty(node, sizeof(inode_t));
+    memcpy(node->extent, header + 1, header->count * sizeof(extent_t));
+    node->extent_count = header->count;
+    node->extent_depth = header->depth;
+    free_block(bnum);
+  }
+}
+
+// add an extent, merging it with its neighbours when they are contiguous on disk
+int extent_insert(inode_t *node, extent_t ext) {
+  invalidate_cursor(node);
+  while (1) {
+    tree_path_t path;
+    find_path(node, ext.file_bnum, &path);
+    int level = path.len - 1;
+    tree_node_t leaf = get_node(node, path.bnum[level]);
+    int idx = path.idx[level];
+    extent_t *prev = idx >= 0 ? &leaf.entries[idx] : NULL;
+    extent_t *next = idx + 1 < *leaf.count ? &leaf.entries[idx + 1] : NULL;
+
+    if (prev != NULL && prev->file_bnum + prev->length == ext.file_bnum &&
+        prev->start + prev->length == ext.start) {
+      dirty_node(node, &leaf);
+      prev->length += ext.length;
+      // the extent may have closed the gap to the next one as well
+      if (next != NULL && prev->file_bnum + prev->length == next->file_bnum &&
+          prev->start + prev->length == next->start) {
+        prev->length += next->length;
+        remove_entry(node, &path, level, idx + 1);
+      }
+      return 0;
+    }
+    if (next != NULL && ext.file_bnum + ext.length == next->file_bnum &&
+        ext.start + ext.length == next->start) {
+      dirty_node(node, &leaf);
+      next->file_bnum = ext.file_bnum;
+      next->start = ext.start;
+      next->length += ext.length;
+      return 0;
+    }
+
+    if (*leaf.count < leaf.max) {
+      dirty_node(node, &leaf);
+      memmove(&leaf.entries[idx + 2], &leaf.entries[idx + 1], (*leaf.count - idx - 1) * sizeof(extent_t));
+      leaf.entries[idx + 1] = ext;
+      (*leaf.count)++;
+      return 0;
+    }
+    if (make_room(node, &path, level) < 0) {
+      return -1;
+    }
+  }
+}
+
+// unmap and free the data blocks in [from, to), one extent at a time
+int extent_remove(inode_t *node, int from, int to) {
+  int freed = 0;
+  while (from < to) {
+    extent_t ext;
+    if (!lookup(node, from, &ext, 0)) {
+      // skip the hole
+      if (ext.length >= to - from) {
+        break;
+      }
+      from += ext.length;
+      lookup(node, from, &ext, 0);
+    }
+
+    int end = ext.file_bnum + ext.length;
+    int cut_lo = from;
+    int cut_hi = to < end ? to : end;
+    if (cut_lo > ext.file_bnum && cut_hi < end) {
+      // punching out the middle leaves a tail that needs its own extent
+      extent_t tail = {cut_hi, ext.start + (cut_hi - ext.file_bnum), end - cut_hi};
+      if (extent_insert(node, tail) < 0) {
+        invalidate_cursor(node);
+        return -1;
+      }
+    }
+
+    tree_path_t path;
+    find_path(node, ext.file_bnum, &path);
+    int level = path.len - 1;
+    tree_node_t leaf = get_node(node, path.bnum[level]);
+    extent_t *cur = &leaf.entries[path.idx[level]];
+    dirty_node(node, &leaf);
+    if (cut_lo == ext.file_bnum && cut_hi == end) {
+      remove_entry(node, &path, level, path.idx[level]);
+    } else if (cut_lo == ext.file_bnum) {
+      cur->file_bnum = cut_hi;
+      cur->start += cut_hi - ext.file_bnum;
+      cur->length = end - cut_hi;
+    } else {
+      cur->length = cut_lo - ext.file_bnum;
+    }
+    free_blocks(ext.start + (cut_lo - ext.file_bnum), cut_hi - cut_lo);
+    freed += cut_hi - cut_lo;
+    from = cut_hi;
+  }
+  collapse_root(node);
+  invalidate_cursor(node);
+  return freed;
+}
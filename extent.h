@@ -0,0 +1,55 @@
+// Extent tree manipulation routines.
+//
+// A file's blocks are described by extents, runs of blocks that are
+// contiguous both in the file and on disk. The extents form a B+ tree whose
+// root lives in the inode. While they fit, the inode holds the extents
+// themselves; once they don't, the root is pushed down into a tree block and
+// the inode holds index entries instead, adding a level each time the root
+// fills up again (the extent equivalent of double and triple indirect blocks).
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "inode.h"
+
+// header at the start of every extent tree block
+// the entries follow it. in leaves (depth 0) they are extents; in index
+// blocks they are extent_t entries whose file_bnum is the first file block
+// covered by the child and whose start is the child's block number
+typedef struct extent_header {
+  int count; // number of entries in use
+  int depth; // 0 for a leaf, otherwise the number of levels below this block
+} extent_header_t;
+
+// find the extent holding the given file block
+// lookups remember the last tree block they ended in for each inode, so
+// sequential access does not walk down from the inode every time
+// param node: pointer to the inode
+// param file_bnum: the index of the block within the file
+// param ext: output for the extent. for an unmapped block it gets a hole
+//            starting at file_bnum with start -1, running up to the next extent
+// returns: 1 if the block is mapped, 0 if it is in a hole
+int extent_lookup(inode_t *node, int file_bnum, extent_t *ext);
+
+// get the last extent of the file
+// param node: pointer to the inode
+// param ext: output for the extent
+// returns: 1 if the file has any extents, 0 otherwise
+int extent_last(inode_t *node, extent_t *ext);
+
+// add an extent for blocks that are not mapped yet, merging it with its
+// neighbours when they are contiguous on disk
+// param node: pointer to the inode
+// param ext: the extent to add
+// returns: 0 if successful, -1 if a tree block could not be allocated
+int extent_insert(inode_t *node, extent_t ext);
+
+// unmap and free the data blocks in the range [from, to) of the file,
+// along with any tree blocks that are no longer needed
+// param node: pointer to the inode
+// param from: first file block to remove
+// param to: file block after the last one to remove
+// returns: the number of data blocks freed, or -1 if splitting an extent failed
+int extent_remove(inode_t *node, int from, int to);
+
+#endif
@@ -2,250 +2,1152 @@
 
 #include <errno.h>
 #include "inode.h"
+#include "extent.h"
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "bitmap.h"
+#include "journal.h"
+#include "log.h"
 #include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+// number of inode locks, inodes whose numbers are equal modulo this share one
+#define INODE_LOCK_STRIPES 1024
+// runs of blocks map_range reads in together
+#define MAP_BATCH 64
+// blocks prefetched past a sequential read to begin with, the window doubles
+// with every read that follows on up to READAHEAD_MAX bytes
+#define READAHEAD_MIN 4
+#define READAHEAD_MAX (1 << 20)
+
+static pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES] = {
+  [0 ... INODE_LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+// protects the inode bitmap and the search position in it
+static pthread_mutex_t inode_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// for each inode, how many times it was handed out by inode number, e.g. in a
+// FUSE lookup, and not yet given back. an inode whose last link goes away is
+// only freed once this drops to 0
+static long *pins = NULL;
+
+// for each inode, bumped whenever blocks are unmapped so inode_map_hint_t
+// entries taken before can tell they are stale. only changed under the
+// inode's write lock
+static uint32_t *map_gens = NULL;
+
+// for each inode, the number of the commit that writes its last change, see
+// journal_epoch. finer than the journal's dirty blocks, which hold many inodes
+static uint64_t *changed_in = NULL;
+
+// INODE_HOLE_SIZE bytes of read-only zeros that inode_read_map points holes
+// at. anonymous memory, so reading it doesn't use any
+static char *zeros = NULL;
+
+// where the last read of a file ended and how far past that its blocks are
+// on their way. reads only hold the inode's read lock, so it is loaded and
+// stored whole and a read racing another one at most loses an update
+typedef struct readahead {
+  int next;        // the block of the file a read following on from the last one starts in
+  uint16_t window; // blocks to keep prefetched past next, 0 after a random read
+  uint16_t ahead;  // blocks past next prefetched already
+} readahead_t;
+
+// for each inode, its readahead state
+static readahead_t *readaheads = NULL;
+
+// a block of a regular file written while it was a hole, kept in memory
+// until the file is flushed. its place on disk is only picked then, when
+// the run it belongs to has its final length (delayed allocation)
+typedef struct delayed_block {
+  int file_bnum;
+  char *data; // BLOCK_SIZE bytes
+} delayed_block_t;
+
+// the delayed blocks of one file, sorted by file_bnum
+typedef struct delayed_list {
+  int count;
+  int capacity;
+  delayed_block_t *blocks;
+} delayed_list_t;
+
+// for each inode, its delayed blocks or NULL. changed under the inode's
+// write lock inside a transaction, every commit flushes them
+static delayed_list_t **delayed = NULL;
+
+// a bit for each inode with delayed blocks, and for each regular file whose
+// blocks may be in the block cache, so commits only visit those. a bit is
+// changed under the inode's lock, atomically since other inodes share its word
+static uint64_t *delayed_files = NULL;
+static uint64_t *cached_files = NULL;
+
+// set or clear the inode's bit in one of the sets of files. the bit
+// is looked at first, the same ones are set over and over
+static void mark_file(uint64_t *set, int inum, int v) {
+  uint64_t bit = 1ull << (inum % 64);
+  if (!(__atomic_load_n(&set[inum / 64], __ATOMIC_RELAXED) & bit) == !v) {
+    return;
+  }
+  if (v) {
+    __atomic_fetch_or(&set[inum / 64], bit, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_and(&set[inum / 64], ~bit, __ATOMIC_RELAXED);
+  }
+}
+
+// get the first inode at or after from whose bit in the set is set
+// returns: the inode number, or INODE_COUNT if there is none
+static int next_file(uint64_t *set, int from) {
+  int words = (INODE_COUNT + 63) / 64;
+  int ww = from / 64;
+  if (ww >= words) {
+    return INODE_COUNT;
+  }
+  uint64_t word = __atomic_load_n(&set[ww], __ATOMIC_RELAXED) & (~0ull << (from % 64));
+  while (word == 0) {
+    if (++ww >= words) {
+      return INODE_COUNT;
+    }
+    word = __atomic_load_n(&set[ww], __ATOMIC_RELAXED);
+  }
+  int inum = ww * 64 + __builtin_ctzll(word);
+  return inum < INODE_COUNT ? inum : INODE_COUNT;
+}
+
+// free an inode that has no links and nothing holding its number
+static void release_inode(int inum);
+
+// flush the delayed blocks of every file and trim the block cache
+static void before_commit();
+
+void inode_init() {
+  pins = calloc(INODE_COUNT, sizeof(long));
+  map_gens = calloc(INODE_COUNT, sizeof(uint32_t));
+  changed_in = calloc(INODE_COUNT, sizeof(uint64_t));
+  delayed = calloc(INODE_COUNT, sizeof(delayed_list_t *));
+  readaheads = calloc(INODE_COUNT, sizeof(readahead_t));
+  delayed_files = calloc((INODE_COUNT + 63) / 64, sizeof(uint64_t));
+  cached_files = calloc((INODE_COUNT + 63) / 64, sizeof(uint64_t));
+  assert(pins != NULL && map_gens != NULL && changed_in != NULL && delayed != NULL &&
+         readaheads != NULL && delayed_files != NULL && cached_files != NULL);
+  journal_set_flush(before_commit);
+  zeros = mmap(NULL, INODE_HOLE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(zeros != MAP_FAILED);
+  // inodes that were unlinked while still pinned when the file system last
+  // stopped are freed now. the root is the only inode that has no links
+  for (int inum = 1; inum < INODE_COUNT; inum++) {
+    if (bitmap_get(get_inode_bitmap(), inum) && get_inode(inum)->refs <= 0) {
+      log_info("reclaiming orphaned inode %d", inum);
+      release_inode(inum);
+    }
+  }
+}
 
 // get the inode number of the first free inode
 int first_free_inode();
 
+
+// get the inode number of an inode in the table
+static int node_inum(inode_t *node);
+
+// mark part of a file's blocks as changed, before changing it. the blocks of
+// regular files are data, directories and their indexes are metadata, and
+// inline data is part of the inode
+static void dirty_blocks(inode_t *node, const void *addr, size_t len) {
+  if (node->flags & INODE_INLINE) {
+    inode_dirty(node);
+  } else if ((node->mode & 0170000) == 0100000) {
+    mark_file(cached_files, node_inum(node), 1);
+    journal_dirty_data(addr, len);
+  } else {
+    journal_dirty(addr, len);
+  }
+}
+
+// set the inode's bit in the inode bitmap
+// the caller must hold inode_bitmap_lock
+static void put_inode_bit(int inum, int v) {
+  journal_dirty((char *) get_inode_bitmap() + inum / 8, 1);
+  bitmap_put(get_inode_bitmap(), inum, v);
+}
+
 void print_inode(inode_t *node) {
-  printf("Inode %p: number of references = %d, mode = %d, size = %d, blocks: ",
+  printf("Inode %p: number of references = %d, mode = %d, size = %ld, extents: ",
          node, node->refs, node->mode, node->size);
-  for (int i = 0; i < node->num_blocks; i++) {
-    printf(", %d", node->block[i]);
+  if (node->flags & INODE_INLINE) {
+    printf("inline");
+    return;
+  }
+  extent_t ext;
+  for (int bnum = 0; bnum < bytes_to_blocks(node->size); bnum += ext.length) {
+    if (extent_lookup(node, bnum, &ext)) {
+      printf(", %d+%d@%d", ext.file_bnum, ext.length, ext.start);
+    }
   }
 }
 
 inode_t *get_inode(int inum) {
   //printf("get inode number %d\n", inum);
-  int block_num = 1 + inum / (BLOCK_SIZE / sizeof(inode_t));
+  superblock_t *sb = get_superblock();
+  int block_num = sb->inode_table_start + inum / (BLOCK_SIZE / sizeof(inode_t));
   int inum_in_block =  inum % (BLOCK_SIZE / sizeof(inode_t));
-  assert(block_num > 0 && block_num <= NUM_INODE_BLOCKS + 1);
+  assert(inum >= 0 && inum < INODE_COUNT);
   // get the block of the inode and then get the inode in the block
   inode_t* node = &((inode_t*) blocks_get_block(block_num))[inum_in_block];
   //print_inode(node);
   return node;
 }
 
+// allocate up to count blocks for the file starting at file_bnum, in one run
+// on disk. the run is placed directly after the block before file_bnum in
+// the file when that one is free, which just lengthens its extent. in a
+// hole it follows the file's last block instead
+// param reserved: 1 to take blocks reserved for delayed blocks
+// param got: output for the number of blocks allocated
+// returns: the first new block number or -1 if the disk is full
+static int alloc_file_blocks(inode_t *node, int file_bnum, int count, int reserved, int *got) {
+  extent_t prev;
+  int goal = -1;
+  if (file_bnum > 0 && extent_lookup(node, file_bnum - 1, &prev)) {
+    goal = prev.start + (file_bnum - prev.file_bnum);
+  } else if (extent_last(node, &prev)) {
+    goal = prev.start + prev.length;
+  }
+  int bnum = reserved ? alloc_blocks_reserved(goal, count, got) : alloc_blocks_near(goal, count, got);
+  if (bnum < 0) {
+    return -1;
+  }
+  extent_t ext = {file_bnum, bnum, *got};
+  if (extent_insert(node, ext) < 0) {
+    free_blocks(bnum, *got);
+    return -1;
+  }
+  inode_dirty(node);
+  node->num_blocks += *got;
+  return bnum;
+}
+
+// get the inode number of an inode in the table, the inverse of get_inode
+static int node_inum(inode_t *node) {
+  char *table = blocks_get_block(get_superblock()->inode_table_start);
+  int64_t offset = (char *) node - table;
+  return offset / BLOCK_SIZE * (BLOCK_SIZE / sizeof(inode_t)) + offset % BLOCK_SIZE / sizeof(inode_t);
+}
+
+// links change under the directory's lock, not the inode's, so the commit
+// numbers are read and written atomically
+void inode_dirty(inode_t *node) {
+  journal_dirty(node, sizeof(inode_t));
+  __atomic_store_n(&changed_in[node_inum(node)], journal_epoch() + 1, __ATOMIC_RELAXED);
+}
+
+int inode_changed(int inum) {
+  return __atomic_load_n(&changed_in[inum], __ATOMIC_RELAXED) > journal_epoch();
+}
+
+// the index of the first delayed block at or after file_bnum, or the count
+// of them if there is none
+static int delayed_index(delayed_list_t *list, int file_bnum) {
+  int lo = 0;
+  int hi = list->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (list->blocks[mid].file_bnum < file_bnum) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// look for a delayed block in a hole of the file
+// param run: the length of the hole at file_bnum, cut short at the next delayed block
+// returns: the delayed block's memory, with run set to 1, or NULL if file_bnum has none
+static char *find_delayed(int inum, int file_bnum, int *run) {
+  delayed_list_t *list = delayed[inum];
+  if (list == NULL) {
+    return NULL;
+  }
+  int ii = delayed_index(list, file_bnum);
+  if (ii < list->count) {
+    if (list->blocks[ii].file_bnum == file_bnum) {
+      *run = 1;
+      return list->blocks[ii].data;
+    }
+    if (list->blocks[ii].file_bnum - file_bnum < *run) {
+      *run = list->blocks[ii].file_bnum - file_bnum;
+    }
+  }
+  return NULL;
+}
+
+// forget an inode's delayed blocks from index at on
+static void cut_delayed(int inum, int at) {
+  delayed_list_t *list = delayed[inum];
+  list->count = at;
+  if (list->count == 0) {
+    free(list->blocks);
+    free(list);
+    delayed[inum] = NULL;
+    mark_file(delayed_files, inum, 0);
+  }
+}
+
+// drop the delayed blocks from file_bnum on, along with their reservations
+static void drop_delayed(int inum, int file_bnum) {
+  delayed_list_t *list = delayed[inum];
+  if (list == NULL) {
+    return;
+  }
+  int at = delayed_index(list, file_bnum);
+  int dropped = list->count - at;
+  for (int ii = at; ii < list->count; ii++) {
+    free(list->blocks[ii].data);
+  }
+  cut_delayed(inum, at);
+  blocks_unreserve(dropped);
+  journal_hold(-dropped);
+}
 
-// allocate a new inode setting all fields to 0 except the first direct block which is allocated
-// and the rest of the direct blocks and the indirect block, which are set to -1
+// add delayed blocks for count blocks of a hole starting at file_bnum, for
+// writing n bytes at offset. a new block is cleared like in fill_holes
+// returns: the number of blocks added, fewer than count if memory ran out
+static int add_delayed(int inum, inode_t *node, int file_bnum, int count, int64_t offset, int64_t n) {
+  delayed_list_t *list = delayed[inum];
+  if (list == NULL) {
+    list = calloc(1, sizeof(delayed_list_t));
+    if (list == NULL) {
+      return 0;
+    }
+    delayed[inum] = list;
+    mark_file(delayed_files, inum, 1);
+  }
+  if (list->count + count > list->capacity) {
+    int capacity = list->capacity * 2 > list->count + count ? list->capacity * 2 : list->count + count;
+    delayed_block_t *blocks = realloc(list->blocks, capacity * sizeof(delayed_block_t));
+    if (blocks == NULL) {
+      return 0;
+    }
+    list->blocks = blocks;
+    list->capacity = capacity;
+  }
+  int at = delayed_index(list, file_bnum);
+  int tail = list->count - at;
+  memmove(&list->blocks[at + count], &list->blocks[at], tail * sizeof(delayed_block_t));
+  for (int ii = 0; ii < count; ii++) {
+    char *data = malloc(BLOCK_SIZE);
+    if (data == NULL) {
+      memmove(&list->blocks[at + ii], &list->blocks[at + count], tail * sizeof(delayed_block_t));
+      list->count += ii;
+      return ii;
+    }
+    int64_t start = (int64_t) (file_bnum + ii) * BLOCK_SIZE;
+    if (start < node->size || start < offset || start + BLOCK_SIZE > offset + n) {
+      memset(data, 0, BLOCK_SIZE);
+    }
+    list->blocks[at + ii].file_bnum = file_bnum + ii;
+    list->blocks[at + ii].data = data;
+  }
+  list->count += count;
+  return count;
+}
+
+// give the holes under n bytes at offset delayed blocks, reserving the
+// blocks they will be put in so flushing them can't run out of space
+// returns: 0 if successful, -1 if there isn't enough space or memory
+static int delay_holes(int inum, inode_t *node, int64_t offset, int64_t n) {
+  if (n <= 0) {
+    return 0;
+  }
+  int first = offset / BLOCK_SIZE;
+  int last = (offset + n - 1) / BLOCK_SIZE;
+  int holes = 0;
+  for (int file_bnum = first; file_bnum <= last;) {
+    int run;
+    if (inode_map(node, file_bnum, &run) < 0 && find_delayed(inum, file_bnum, &run) == NULL) {
+      holes += run > last - file_bnum ? last - file_bnum + 1 : run;
+    }
+    file_bnum += run;
+  }
+  if (holes == 0) {
+    return 0;
+  }
+  if (blocks_reserve(holes) < 0) {
+    return -1;
+  }
+  int added = 0;
+  for (int file_bnum = first; file_bnum <= last;) {
+    int run;
+    if (inode_map(node, file_bnum, &run) < 0 && find_delayed(inum, file_bnum, &run) == NULL) {
+      int count = run > last - file_bnum ? last - file_bnum + 1 : run;
+      int got = add_delayed(inum, node, file_bnum, count, offset, n);
+      added += got;
+      if (got < count) {
+        break;
+      }
+    }
+    file_bnum += run;
+  }
+  journal_hold(added);
+  if (added < holes) {
+    blocks_unreserve(holes - added);
+    return -1;
+  }
+  return 0;
+}
+
+// each run of consecutive delayed blocks goes to one run on disk when the
+// free space allows, placed like any other new blocks of the file
+int inode_flush(inode_t *node) {
+  int inum = node_inum(node);
+  delayed_list_t *list = delayed[inum];
+  if (list == NULL) {
+    return 0;
+  }
+  int done = 0;
+  int rv = 0;
+  while (done < list->count) {
+    int end = done + 1;
+    while (end < list->count && list->blocks[end].file_bnum == list->blocks[end - 1].file_bnum + 1) {
+      end++;
+    }
+    int got;
+    int bnum = alloc_file_blocks(node, list->blocks[done].file_bnum, end - done, 1, &got);
+    if (bnum < 0) {
+      rv = -1;
+      break;
+    }
+    char *blocks = blocks_get_new(bnum, got);
+    mark_file(cached_files, inum, 1);
+    for (int ii = 0; ii < got; ii++) {
+      char *block = blocks + (int64_t) ii * BLOCK_SIZE;
+      journal_dirty_data(block, BLOCK_SIZE);
+      memcpy(block, list->blocks[done + ii].data, BLOCK_SIZE);
+      free(list->blocks[done + ii].data);
+    }
+    blocks_unreserve(got);
+    done += got;
+  }
+  int left = list->count - done;
+  memmove(list->blocks, &list->blocks[done], left * sizeof(delayed_block_t));
+  cut_delayed(inum, left);
+  journal_hold(-done);
+  return rv;
+}
+
+int inode_delayed_blocks(int inum) {
+  return delayed[inum] == NULL ? 0 : delayed[inum]->count;
+}
+
+// nothing else runs during a commit, but reads still can
+static void flush_delayed() {
+  for (int inum = next_file(delayed_files, 0); inum < INODE_COUNT;
+       inum = next_file(delayed_files, inum + 1)) {
+    inode_lock_write(inum);
+    if (inode_flush(get_inode(inum)) < 0) {
+      log_warn("no space to flush the delayed blocks of inode %d", inum);
+    }
+    inode_unlock(inum);
+  }
+}
+
+// where the next shrink_cache starts looking
+static int next_shrink = 0;
+
+// give back the memory the block cache holds for the data of regular files
+// beyond its budget, a file at a time, starting where the last commit left
+// off. readers of a file's blocks hold its lock. directories are left
+// alone, their index is read under the directory's lock rather than its own
+static void shrink_cache() {
+  long excess = blocks_cache_excess();
+  int start = next_shrink;
+  int wrapped = 0;
+  int inum = next_file(cached_files, start);
+  while (excess > 0) {
+    if (inum >= INODE_COUNT) {
+      if (wrapped) {
+        break;
+      }
+      wrapped = 1;
+      inum = next_file(cached_files, 0);
+      continue;
+    }
+    if (wrapped && inum >= start) {
+      break;
+    }
+    inode_lock_write(inum);
+    inode_t *node = get_inode(inum);
+    int dropped_all = 1;
+    if (bitmap_get(get_inode_bitmap(), inum) &&
+        (node->mode & 0170000) == 0100000 && !(node->flags & INODE_INLINE)) {
+      int blocks = bytes_to_blocks(node->size);
+      int file_bnum = 0;
+      while (file_bnum < blocks && excess > 0) {
+        int run;
+        int bnum = inode_map(node, file_bnum, &run);
+        if (bnum >= 0) {
+          excess -= blocks_drop(bnum, run);
+        }
+        file_bnum += run;
+      }
+      dropped_all = file_bnum >= blocks;
+    }
+    // the file's next read or write marks it again
+    if (dropped_all) {
+      mark_file(cached_files, inum, 0);
+    }
+    inode_unlock(inum);
+    next_shrink = inum + 1 < INODE_COUNT ? inum + 1 : 0;
+    inum = next_file(cached_files, inum + 1);
+  }
+}
+
+// run by the journal at the start of every commit
+static void before_commit() {
+  flush_delayed();
+  shrink_cache();
+}
+
+// free blocks from the end of the file until only num_blocks are left
+static void truncate_blocks(inode_t *node, int num_blocks) {
+  drop_delayed(node_inum(node), num_blocks);
+  if (node->flags & INODE_INLINE) {
+    return;
+  }
+  inode_dirty(node);
+  node->num_blocks -= extent_remove(node, num_blocks, INT_MAX);
+  map_gens[node_inum(node)]++;
+}
+
+// allocate the blocks in holes under n bytes at offset. a new block is
+// cleared unless the bytes cover it and it is past the end of the file, so
+// whatever isn't written to it reads as zeros even if the write fails
+// returns: 0 if successful, -1 if the disk is full
+static int fill_holes(inode_t *node, int64_t offset, int64_t n) {
+  if ((node->flags & INODE_INLINE) || n <= 0) {
+    return 0;
+  }
+  int last = (offset + n - 1) / BLOCK_SIZE;
+  for (int file_bnum = offset / BLOCK_SIZE; file_bnum <= last;) {
+    int run;
+    if (inode_map(node, file_bnum, &run) >= 0) {
+      file_bnum += run > last - file_bnum ? last - file_bnum + 1 : run;
+      continue;
+    }
+    int got;
+    int bnum = alloc_file_blocks(node, file_bnum, run > last - file_bnum ? last - file_bnum + 1 : run, 0, &got);
+    if (bnum < 0) {
+      return -1;
+    }
+    // every block is either cleared here or written over by the caller
+    char *blocks = blocks_get_new(bnum, got);
+    for (int ii = 0; ii < got; ii++) {
+      int64_t start = (int64_t) (file_bnum + ii) * BLOCK_SIZE;
+      if (start < node->size || start < offset || start + BLOCK_SIZE > offset + n) {
+        char *block = blocks + (int64_t) ii * BLOCK_SIZE;
+        dirty_blocks(node, block, BLOCK_SIZE);
+        memset(block, 0, BLOCK_SIZE);
+      }
+    }
+    file_bnum += got;
+  }
+  return 0;
+}
+
+// make sure the file can hold size bytes. an inline file that would outgrow
+// the inode moves its data to a block of its own
+// returns: 0 if successful, -1 if the disk is full
+static int grow_inline(inode_t *node, int64_t size) {
+  if (!(node->flags & INODE_INLINE) || size <= INODE_INLINE_SIZE) {
+    return 0;
+  }
+  char data[INODE_INLINE_SIZE];
+  memcpy(data, node->inline_data, sizeof(data));
+  inode_dirty(node);
+  node->flags &= ~INODE_INLINE;
+  memset(node->extent, 0, sizeof(node->extent));
+  if (node->size == 0) {
+    return 0;
+  }
+  int got;
+  int bnum = alloc_file_blocks(node, 0, 1, 0, &got);
+  if (bnum < 0) {
+    memcpy(node->inline_data, data, sizeof(data));
+    node->flags |= INODE_INLINE;
+    return -1;
+  }
+  char *block = blocks_get_new(bnum, 1);
+  dirty_blocks(node, block, node->size);
+  memcpy(block, data, node->size);
+  return 0;
+}
+
+// allocate a new inode setting all fields to 0. regular files start out
+// inline, anything else gets its first block allocated
 int alloc_inode(int mode) {
+  pthread_mutex_lock(&inode_bitmap_lock);
   int inum = first_free_inode();
-  bitmap_put(get_inode_bitmap(), inum, 1);
-  inode_t* new_node = get_inode(inum);
-  new_node->block[0] = alloc_block();
-  for (int i = 1; i < NUM_DIRECT_BLOCKS; i++) {
-    new_node->block[i] = -1;
+  if (inum >= 0) {
+    put_inode_bit(inum, 1);
   }
-  new_node->indirect_block = -1;
-  new_node->num_blocks = 1;
+  pthread_mutex_unlock(&inode_bitmap_lock);
+  if (inum < 0) {
+    return -1;
+  }
+  inode_t* new_node = get_inode(inum);
+  inode_dirty(new_node);
+  memset(new_node, 0, sizeof(inode_t));
+  new_node->index_inum = -1;
   new_node->mode = mode;
+  readahead_t ra = {0, 0, 0};
+  __atomic_store(&readaheads[inum], &ra, __ATOMIC_RELAXED);
+  if ((mode & 0170000) == 0100000) {
+    new_node->flags = INODE_INLINE;
+    return inum;
+  }
+  int got;
+  if (alloc_file_blocks(new_node, 0, 1, 0, &got) < 0) {
+    pthread_mutex_lock(&inode_bitmap_lock);
+    put_inode_bit(inum, 0);
+    pthread_mutex_unlock(&inode_bitmap_lock);
+    return -1;
+  }
   return inum;
 }
 
 // returns in inum of the first free inode, and -1 if there are no free inodes
+// the search starts after the last inode handed out so a mostly full table
+// is not rescanned from the beginning every time
+// the caller must hold inode_bitmap_lock
 int first_free_inode() {
-  void* inode_bitmap = get_inode_bitmap();
-  // loop over each inode in the bitmap
-  for (int i = 0; i < (BLOCK_SIZE / sizeof(inode_t)) * NUM_INODE_BLOCKS; i++) {
-    if (!bitmap_get(inode_bitmap, i)) {
-       return i;
-    }
+  static int next_inum = 0;
+  int inum = bitmap_find_free(get_inode_bitmap(), INODE_COUNT, next_inum);
+  if (inum >= 0) {
+    next_inum = inum + 1;
   }
-  return -1;
+  return inum;
 }
 
 // decrease reference count, and if the count hits 0 free the inode by setting fields back to 0, freeing used blocks, and updating the bitmap
-// 
+//
 void free_inode(int inum) {
-  printf("freeing inode %d\n", inum);
-  inode_t node = *get_inode(inum);
-  if (node.refs > 1) {
-    node.refs--;
+  log_trace("freeing inode %d", inum);
+  inode_t *node = get_inode(inum);
+  inode_dirty(node);
+  // links are added under the directory's lock rather than this inode's
+  if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  // still known by number, the last inode_unpin frees it
+  if (__atomic_load_n(&pins[inum], __ATOMIC_ACQUIRE) > 0) {
     return;
-  } else {
-    node.refs = 0;
-    node.mode = 0;
-    node.size = 0;
-    if (node.indirect_block > 0) {
-      int* indirect_block = (int*) blocks_get_block(node.indirect_block);
-      // free all blocks indirectly pointed to
-      while (node.num_blocks > NUM_DIRECT_BLOCKS) {
-        printf("indirectly pointed block");
-        free_block(indirect_block[node.num_blocks - NUM_DIRECT_BLOCKS - 1]);
-        node.num_blocks--;
-      }
-      // free indirect block
-      printf("freeing indrect block %d", node.indirect_block);
-      free_block(node.indirect_block);
-      node.indirect_block = -1; 
-    }
-    // free direct blocks
-    for (int i = 0; i < NUM_DIRECT_BLOCKS; i++) {
-      if (node.block[i] > 0) {
-        free_block(node.block[i]);
-      }
-      node.block[i] = -1;
-      node.num_blocks--;
-    }
-    bitmap_put(get_inode_bitmap(), inum, 0);
   }
+  release_inode(inum);
 }
 
-int grow_inode(inode_t *node, int size) {
-  int space_remaining = (node->num_blocks * BLOCK_SIZE) - node->size; 
-  if (space_remaining >= size) {
-    node->size += size;
-  } else {
-    int next_block = alloc_block();
-    if (next_block < 0) {
-      return -1;
+static void release_inode(int inum) {
+  inode_t *node = get_inode(inum);
+  inode_dirty(node);
+  // a directory's hash index goes with it
+  if (node->index_inum >= 0) {
+    free_inode(node->index_inum);
+    node->index_inum = -1;
+  }
+  // free the data blocks one extent at a time, and the tree blocks along with them
+  truncate_blocks(node, 0);
+  node->refs = 0;
+  node->mode = 0;
+  node->size = 0;
+  pthread_mutex_lock(&inode_bitmap_lock);
+  put_inode_bit(inum, 0);
+  pthread_mutex_unlock(&inode_bitmap_lock);
+}
+
+void inode_pin(int inum, long count) {
+  __atomic_add_fetch(&pins[inum], count, __ATOMIC_ACQ_REL);
+}
+
+void inode_unpin(int inum, long count) {
+  inode_lock_write(inum);
+  if (__atomic_sub_fetch(&pins[inum], count, __ATOMIC_ACQ_REL) <= 0 && inum != 0 &&
+      bitmap_get(get_inode_bitmap(), inum) && get_inode(inum)->refs <= 0) {
+    release_inode(inum);
+  }
+  inode_unlock(inum);
+}
+
+void inode_lock_read(int inum) {
+  pthread_rwlock_rdlock(&inode_locks[inum % INODE_LOCK_STRIPES]);
+}
+
+void inode_lock_write(int inum) {
+  pthread_rwlock_wrlock(&inode_locks[inum % INODE_LOCK_STRIPES]);
+}
+
+void inode_unlock(int inum) {
+  pthread_rwlock_unlock(&inode_locks[inum % INODE_LOCK_STRIPES]);
+}
+
+// zero n bytes of the file starting at offset, a contiguous run at a time.
+// holes already read as zeros
+static void zero_range(inode_t *node, int64_t offset, int64_t n) {
+  if (node->flags & INODE_INLINE) {
+    inode_dirty(node);
+    memset(node->inline_data + offset, 0, n);
+    return;
+  }
+  int inum = node_inum(node);
+  while (n > 0) {
+    int run;
+    int bnum = inode_map(node, offset / BLOCK_SIZE, &run);
+    char *data = bnum < 0 ? find_delayed(inum, offset / BLOCK_SIZE, &run) : NULL;
+    int64_t chunk = (int64_t) run * BLOCK_SIZE - offset % BLOCK_SIZE;
+    if (chunk > n) {
+      chunk = n;
     }
-    if (node->num_blocks < NUM_DIRECT_BLOCKS) {
-      // allocate normal block
-      node->size += size;
-      node->block[node->num_blocks] = next_block;
-      node->num_blocks++;
-    } else {
-      if (node->num_blocks == NUM_DIRECT_BLOCKS) {
-        // allocate indirect block with all blocks as -1
-        node->indirect_block = next_block;
-        next_block = alloc_block();
-        for (int i = 0; i < BLOCK_SIZE; i++) {
-          ((int*) blocks_get_block(node->indirect_block))[i] = -1;
-        }
-        if (next_block < 0) {
-          return -1;
-        }
-      }
-      // allocate new block in indirect block
-      ((int*) blocks_get_block(node->indirect_block))[node->num_blocks - NUM_DIRECT_BLOCKS] = next_block;
-      node->num_blocks++;
-      node->size += size;
+    if (bnum >= 0) {
+      char *addr = (char *) blocks_get_blocks(bnum, bytes_to_blocks(offset % BLOCK_SIZE + chunk)) +
+                   offset % BLOCK_SIZE;
+      dirty_blocks(node, addr, chunk);
+      memset(addr, 0, chunk);
+    } else if (data != NULL) {
+      memset(data + offset % BLOCK_SIZE, 0, chunk);
     }
+    offset += chunk;
+    n -= chunk;
   }
+}
+
+// grow the file by size bytes, the new bytes read back as zeros. no blocks
+// are allocated, past the last one the file is a hole
+int grow_inode(inode_t *node, int64_t size) {
+  if (grow_inline(node, node->size + size) < 0) {
+    return -1;
+  }
+  zero_range(node, node->size, size);
+  inode_dirty(node);
+  node->size += size;
   return 0;
 }
 
-int shrink_inode(inode_t *node, int size) {
-  if (node->num_blocks == 1 && node->size < size) {
+// shrink the file by size bytes, freeing the blocks that are no longer used
+int shrink_inode(inode_t *node, int64_t size) {
+  if (size > node->size) {
     return -1;
   }
-  int space_remaining = (node->num_blocks * BLOCK_SIZE) - node->size; 
-  if (BLOCK_SIZE - space_remaining >= size) {
-    node->size -= size;
-  } else {
-    if (node->num_blocks <= NUM_DIRECT_BLOCKS) {
-      // deallocate normal block
-      node->size -= size;
-      free_block(node->block[node->num_blocks]);
-      node->block[node->num_blocks] = -1;
-      node->num_blocks--;
-    } else {
-      // deallocate new block in indirect block
-      int cur_block = ((int*) blocks_get_block(node->indirect_block))[node->num_blocks - NUM_DIRECT_BLOCKS];
-      free_block(cur_block);
-      cur_block = -1;
-      if (node->num_blocks == (NUM_DIRECT_BLOCKS + 1)) {
-        // deallocate indirect block
-        free_block(node->indirect_block);
-        node->indirect_block = -1;
+  inode_dirty(node);
+  node->size -= size;
+  truncate_blocks(node, bytes_to_blocks(node->size));
+  // an emptied regular file starts over inline
+  if (node->size == 0 && (node->mode & 0170000) == 0100000) {
+    node->flags |= INODE_INLINE;
+  }
+  return 0;
+}
+
+// allocate the holes in the range a run at a time, as long as the free space
+// allows. the new blocks are cleared without going through memory. bytes
+// that become part of the file are zeroed first, like grow_inode does, so
+// the new blocks are left alone
+int inode_allocate(inode_t *node, int64_t offset, int64_t len, int keep_size) {
+  int64_t end = offset + len;
+  if (inode_flush(node) < 0 || grow_inline(node, end) < 0) {
+    return -1;
+  }
+  int grow = !keep_size && end > node->size;
+  if (grow) {
+    zero_range(node, node->size, end - node->size);
+  }
+  if (!(node->flags & INODE_INLINE)) {
+    int last = (end - 1) / BLOCK_SIZE;
+    for (int file_bnum = offset / BLOCK_SIZE; file_bnum <= last;) {
+      int run;
+      if (inode_map(node, file_bnum, &run) >= 0) {
+        file_bnum += run;
+        continue;
+      }
+      int got;
+      int bnum = alloc_file_blocks(node, file_bnum, run > last - file_bnum ? last - file_bnum + 1 : run, 0, &got);
+      if (bnum < 0) {
+        return -1;
       }
-      node->num_blocks++;
-      node->size -= size;
+      journal_zero(bnum, got);
+      file_bnum += got;
     }
   }
+  if (grow) {
+    inode_dirty(node);
+    node->size = end;
+  }
   return 0;
 }
 
+// zero the bytes of [from, to) that are within the file
+static void zero_within(inode_t *node, int64_t from, int64_t to) {
+  if (to > node->size) {
+    to = node->size;
+  }
+  if (from < to) {
+    zero_range(node, from, to - from);
+  }
+}
+
+// free the blocks the range covers whole, and zero the bytes of the partly
+// covered blocks at its ends
+int inode_punch(inode_t *node, int64_t offset, int64_t len) {
+  int64_t end = offset + len;
+  int64_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int64_t last = end / BLOCK_SIZE < INT_MAX ? end / BLOCK_SIZE : INT_MAX;
+  if ((node->flags & INODE_INLINE) || first >= last) {
+    zero_within(node, offset, end);
+    return 0;
+  }
+  if (inode_flush(node) < 0) {
+    return -1;
+  }
+  inode_dirty(node);
+  int freed = extent_remove(node, first, last);
+  map_gens[node_inum(node)]++;
+  if (freed < 0) {
+    return -1;
+  }
+  node->num_blocks -= freed;
+  zero_within(node, offset, first * BLOCK_SIZE);
+  zero_within(node, last * BLOCK_SIZE, end);
+  return 0;
+}
+
+// map a block of the file to its disk block through the extent tree
+int inode_map(inode_t *node, int file_bnum, int *run) {
+  extent_t ext;
+  int mapped = extent_lookup(node, file_bnum, &ext);
+  int offset = file_bnum - ext.file_bnum;
+  if (run != NULL) {
+    *run = ext.length - offset;
+  }
+  return mapped ? ext.start + offset : -1;
+}
+
+int64_t inode_seek(inode_t *node, int64_t offset, int hole) {
+  if (offset < 0 || offset >= node->size) {
+    return -ENXIO;
+  }
+  if (node->flags & INODE_INLINE) {
+    return hole ? node->size : offset;
+  }
+  int inum = node_inum(node);
+  int64_t pos = offset;
+  while (pos < node->size) {
+    int run;
+    // delayed blocks are data that has no block yet
+    int data = inode_map(node, pos / BLOCK_SIZE, &run) >= 0 ||
+               find_delayed(inum, pos / BLOCK_SIZE, &run) != NULL;
+    if (data != hole) {
+      return pos;
+    }
+    pos = (pos / BLOCK_SIZE + run) * BLOCK_SIZE;
+  }
+  return hole ? node->size : -ENXIO;
+}
+
+int inode_is_hole(const void *addr) {
+  return (const char *) addr >= zeros && (const char *) addr < zeros + INODE_HOLE_SIZE;
+}
+
 // get the block number of the given inode at the given offset
-int inode_get_bnum(inode_t *node, int offset) {
-  int file_bnum = offset / BLOCK_SIZE;
-  if (file_bnum >= node->num_blocks) {
+int inode_get_bnum(inode_t *node, int64_t offset) {
+  if (offset < 0) {
     return -1;
   }
-  if (file_bnum <= NUM_DIRECT_BLOCKS) {
-    return node->block[file_bnum];
-  } else {
-    return ((int*) blocks_get_block(node->indirect_block))[file_bnum - NUM_DIRECT_BLOCKS];
+  return inode_map(node, offset / BLOCK_SIZE, NULL);
+}
+
+static void hint_lock(inode_map_hint_t *hint) {
+  while (__atomic_test_and_set(&hint->lock, __ATOMIC_ACQUIRE)) {
+  }
+}
+
+static void hint_unlock(inode_map_hint_t *hint) {
+  __atomic_clear(&hint->lock, __ATOMIC_RELEASE);
+}
+
+// map a block of the file like inode_map, trying the hint before the extent tree
+static int map_hinted(int inum, inode_t *node, inode_map_hint_t *hint, int file_bnum, int *run) {
+  if (hint == NULL) {
+    return inode_map(node, file_bnum, run);
+  }
+  // several threads may use one hint, e.g. reads through the same handle
+  hint_lock(hint);
+  extent_t ext = hint->ext;
+  uint32_t gen = hint->gen;
+  hint_unlock(hint);
+  if (gen != map_gens[inum] || file_bnum < ext.file_bnum || file_bnum >= ext.file_bnum + ext.length) {
+    if (!extent_lookup(node, file_bnum, &ext)) {
+      *run = ext.length;
+      return -1;
+    }
+    hint_lock(hint);
+    hint->ext = ext;
+    hint->gen = map_gens[inum];
+    hint_unlock(hint);
+  }
+  int offset = file_bnum - ext.file_bnum;
+  *run = ext.length - offset;
+  return ext.start + offset;
+}
+
+static int map_range(int inum, inode_t *inode, inode_map_hint_t *hint, int64_t offset, int n,
+                     struct iovec *iov, int max_iov);
+
+// prefetch the blocks of the file from first up to end that are on disk
+static void prefetch_range(inode_t *inode, int first, int end) {
+  blocks_run_t runs[MAP_BATCH];
+  int count = 0;
+  while (first < end && count < MAP_BATCH) {
+    int run;
+    int bnum = inode_map(inode, first, &run);
+    run = run < 1 ? 1 : run > end - first ? end - first : run;
+    if (bnum >= 0) {
+      runs[count++] = (blocks_run_t) {bnum, run};
+    }
+    first += run;
   }
+  blocks_prefetch(runs, count);
 }
 
-int inode_read(int inum, char* buf, int n, int size, int offset) {
+// follow the reads of a file, and while they go through it in order keep
+// the next window of blocks prefetched. the window starts out small and
+// grows as the reads keep coming in order, a read anywhere else drops it
+static void read_ahead(int inum, inode_t *inode, int64_t offset, int n) {
+  if (inode->flags & INODE_INLINE) {
+    return;
+  }
+  readahead_t ra;
+  __atomic_load(&readaheads[inum], &ra, __ATOMIC_RELAXED);
+  int first = offset / BLOCK_SIZE;
+  int next = (offset + n) / BLOCK_SIZE;
+  if (first != ra.next) {
+    ra = (readahead_t) {next, 0, 0};
+    __atomic_store(&readaheads[inum], &ra, __ATOMIC_RELAXED);
+    return;
+  }
+  int max_window = READAHEAD_MAX / BLOCK_SIZE;
+  max_window = max_window < READAHEAD_MIN ? READAHEAD_MIN : max_window;
+  max_window = max_window > UINT16_MAX ? UINT16_MAX : max_window;
+  int window = ra.window == 0 ? READAHEAD_MIN : ra.window * 2;
+  window = window > max_window ? max_window : window;
+  int ahead = ra.ahead > next - first ? ra.ahead - (next - first) : 0;
+  // top the window up once half of it was read, so the blocks are asked for
+  // well before the reads get to them
+  if (ahead < window / 2) {
+    int file_blocks = bytes_to_blocks(inode->size);
+    int end = next + window < file_blocks ? next + window : file_blocks;
+    prefetch_range(inode, next + ahead, end);
+    ahead = window;
+  }
+  ra = (readahead_t) {next, window, ahead};
+  __atomic_store(&readaheads[inum], &ra, __ATOMIC_RELAXED);
+}
+
+int inode_read_hint(int inum, inode_map_hint_t *hint, char* buf, int n, int64_t offset) {
   if (inum >= 0 && bitmap_get(get_inode_bitmap(), inum)) {
     inode_t *inode = get_inode(inum);
-    // truncate number of bytes to read to buffer size
-    n = n > size ? size : n;
-    // truncate number of bytes to read to inode data size
-    n = n > inode->size ? inode->size : n;
+    if (offset >= inode->size) {
+      return 0;
+    }
+    // truncate number of bytes to read to the data left in the inode
+    n = n > inode->size - offset ? inode->size - offset : n;
+    if (inode->flags & INODE_INLINE) {
+      memcpy(buf, inode->inline_data + offset, n);
+      return n;
+    }
+    // copy a whole contiguous run of blocks at a time
+    struct iovec iov[16];
     int bytes_read = 0;
-    // get offset within block
-    int char_offset = offset % BLOCK_SIZE;
-    // while there are more bytes to read
-    while (n > 0) {
-      printf("%d blocks to read\n", n);
-      // get block number to read from
-      int read_bnum = inode_get_bnum(inode, offset + bytes_read);
-      // get pointer to read block
-      char *read_p = blocks_get_block(read_bnum);
-      int bytes_left_in_block = BLOCK_SIZE - char_offset;
-      // if n will fit in the block copy n bytes, otherwise copy the rest of the block
-      int bytes_to_copy;
-      if (n < bytes_left_in_block) {
-        bytes_to_copy = n;
-        n = 0;
-      } else {
-        bytes_to_copy = bytes_left_in_block;
-        n -= bytes_left_in_block;
+    while (bytes_read < n) {
+      int count = map_range(inum, inode, hint, offset + bytes_read, n - bytes_read, iov, 16);
+      if (count < 0) {
+        return count;
+      }
+      for (int i = 0; i < count; i++) {
+        if (inode_is_hole(iov[i].iov_base)) {
+          memset(buf + bytes_read, 0, iov[i].iov_len);
+        } else {
+          memcpy(buf + bytes_read, iov[i].iov_base, iov[i].iov_len);
+        }
+        bytes_read += iov[i].iov_len;
       }
-      printf("copying %d bytes from block %d with offset %d.", bytes_to_copy, read_bnum, char_offset);
-      memcpy(buf + bytes_read, read_p + char_offset, bytes_to_copy);
-      char_offset = 0;
-      bytes_read += bytes_to_copy;
     }
+    read_ahead(inum, inode, offset, bytes_read);
     return bytes_read;
   }
 
   return -ENOENT;
 }
 
-int inode_write(int inum, const char* buf, int n, int offset) {
-  if (inum >= 0 && bitmap_get(get_inode_bitmap(), inum)) {
-    inode_t *inode = get_inode(inum);
-    // ensure node is large enouge for the write
-    if (inode->size < offset + n) {
-      grow_inode(inode, offset + n - inode->size);
-    }
-    int bytes_written = 0;
-    // get offset within block
-    int char_offset = offset % BLOCK_SIZE;
-    // while there are more bytes to write
-    while (n > 0) {
-      // get block number to write to
-      int write_bnum = inode_get_bnum(inode, offset + bytes_written);
-      // get pointer to write block
-      char *write_ptr = blocks_get_block(write_bnum);
-      int bytes_left_in_block = BLOCK_SIZE - char_offset;
-
-      // if n will fit in the block copy n bytes, otherwise copy the rest of the block
-      int bytes_to_copy;
-      if (n < bytes_left_in_block) {
-        bytes_to_copy = n;
-        n = 0;
-      } else {
-        bytes_to_copy = bytes_left_in_block;
-        n -= bytes_left_in_block;
+// point the iovecs of a batch of runs of blocks at their memory, once the
+// runs are read in together
+// returns: 0 if successful, -EIO if the blocks couldn't be read
+static int map_batch(struct iovec *iov, const int *at, const blocks_run_t *runs, int count) {
+  if (blocks_load_runs(runs, count) < 0) {
+    return -EIO;
+  }
+  for (int ii = 0; ii < count; ii++) {
+    iov[at[ii]].iov_base = (char *) blocks_get_blocks(runs[ii].bnum, runs[ii].count) +
+                           (size_t) iov[at[ii]].iov_base;
+  }
+  return 0;
+}
+
+// fill iov with the memory holding n bytes of the file at offset. holes are
+// mapped to zeros, at most INODE_HOLE_SIZE bytes per iovec, and delayed
+// blocks to their memory. blocks that have to be read are read MAP_BATCH
+// runs at a time
+// returns: the number of iovecs filled, or -EIO if blocks couldn't be read
+static int map_range(int inum, inode_t *inode, inode_map_hint_t *hint, int64_t offset, int n,
+                     struct iovec *iov, int max_iov) {
+  if (inode->flags & INODE_INLINE) {
+    iov[0].iov_base = inode->inline_data + offset;
+    iov[0].iov_len = n;
+    return 1;
+  }
+  if ((inode->mode & 0170000) == 0100000) {
+    mark_file(cached_files, inum, 1);
+  }
+  blocks_run_t runs[MAP_BATCH];
+  int at[MAP_BATCH];
+  int batched = 0;
+  int count = 0;
+  int64_t mapped = 0;
+  while (mapped < n && count < max_iov) {
+    int64_t pos = offset + mapped;
+    int run;
+    int bnum = map_hinted(inum, inode, hint, pos / BLOCK_SIZE, &run);
+    char *data = bnum < 0 ? find_delayed(inum, pos / BLOCK_SIZE, &run) : NULL;
+    int64_t chunk = (int64_t) run * BLOCK_SIZE - pos % BLOCK_SIZE;
+    if (chunk > n - mapped) {
+      chunk = n - mapped;
+    }
+    if (data != NULL) {
+      iov[count].iov_base = data + pos % BLOCK_SIZE;
+    } else if (bnum < 0) {
+      chunk = chunk > INODE_HOLE_SIZE ? INODE_HOLE_SIZE : chunk;
+      iov[count].iov_base = zeros;
+    } else {
+      // the offset into the run until map_batch knows where it is
+      iov[count].iov_base = (void *) (size_t) (pos % BLOCK_SIZE);
+      runs[batched] = (blocks_run_t) {bnum, bytes_to_blocks(pos % BLOCK_SIZE + chunk)};
+      at[batched] = count;
+      if (++batched == MAP_BATCH) {
+        if (map_batch(iov, at, runs, batched) < 0) {
+          return -EIO;
+        }
+        batched = 0;
       }
-      
-      memcpy(write_ptr + char_offset, buf + bytes_written, bytes_to_copy);
-      char_offset = 0;
-      bytes_written += bytes_to_copy;
     }
-    return bytes_written;
+    iov[count].iov_len = chunk;
+    count++;
+    mapped += chunk;
   }
+  return map_batch(iov, at, runs, batched) < 0 ? -EIO : count;
+}
 
-  return -ENOENT;
+int inode_read_map(int inum, inode_map_hint_t *hint, int64_t offset, int n, struct iovec *iov, int max_iov) {
+  if (inum < 0 || !bitmap_get(get_inode_bitmap(), inum)) {
+    return -ENOENT;
+  }
+  inode_t *inode = get_inode(inum);
+  if (offset >= inode->size) {
+    return 0;
+  }
+  n = n > inode->size - offset ? inode->size - offset : n;
+  int count = map_range(inum, inode, hint, offset, n, iov, max_iov);
+  if (count < 0) {
+    return count;
+  }
+  // the iovecs may run out before n bytes
+  int mapped = 0;
+  for (int ii = 0; ii < count; ii++) {
+    mapped += iov[ii].iov_len;
+  }
+  read_ahead(inum, inode, offset, mapped);
+  return count;
+}
+
+int inode_read(int inum, char* buf, int n, int size, int64_t offset) {
+  // truncate number of bytes to read to buffer size
+  return inode_read_hint(inum, NULL, buf, n > size ? size : n, offset);
+}
+
+// whether memory from map_range is part of the image rather than a delayed block
+static int in_image(const void *addr) {
+  const char *base = (const char *) get_superblock();
+  return (const char *) addr >= base && (const char *) addr < base + NUFS_SIZE;
+}
+
+int inode_write_map(int inum, inode_map_hint_t *hint, int64_t offset, int n, struct iovec *iov, int max_iov) {
+  if (inum < 0 || !bitmap_get(get_inode_bitmap(), inum)) {
+    return -ENOENT;
+  }
+  inode_t *inode = get_inode(inum);
+  // any gap between the end of the file and the write becomes a hole
+  if (inode->size < offset && grow_inode(inode, offset - inode->size) < 0) {
+    return -ENOSPC;
+  }
+  if (grow_inline(inode, offset + n) < 0) {
+    return -ENOSPC;
+  }
+  // the holes of a regular file get delayed blocks, when there is no space
+  // to reserve for them they are allocated right away like anything else's
+  int regular = (inode->mode & 0170000) == 0100000 && !(inode->flags & INODE_INLINE);
+  if ((!regular || delay_holes(inum, inode, offset, n) < 0) &&
+      (inode_flush(inode) < 0 || fill_holes(inode, offset, n) < 0)) {
+    return -ENOSPC;
+  }
+  int count = map_range(inum, inode, hint, offset, n, iov, max_iov);
+  if (count < 0) {
+    return count;
+  }
+  for (int i = 0; i < count; i++) {
+    if (in_image(iov[i].iov_base)) {
+      dirty_blocks(inode, iov[i].iov_base, iov[i].iov_len);
+    }
+  }
+  return count;
+}
+
+void inode_write_done(int inum, int64_t end) {
+  inode_t *inode = get_inode(inum);
+  if (inode->size < end) {
+    inode_dirty(inode);
+    inode->size = end;
+  }
+}
+
+int inode_write_hint(int inum, inode_map_hint_t *hint, const char* buf, int n, int64_t offset) {
+  // copy a whole contiguous run of blocks at a time
+  struct iovec iov[16];
+  int bytes_written = 0;
+  while (bytes_written < n) {
+    int count = inode_write_map(inum, hint, offset + bytes_written, n - bytes_written, iov, 16);
+    if (count < 0) {
+      return count;
+    }
+    for (int i = 0; i < count; i++) {
+      memcpy(iov[i].iov_base, buf + bytes_written, iov[i].iov_len);
+      bytes_written += iov[i].iov_len;
+    }
+    // the next round would take what was written as a gap to zero
+    inode_write_done(inum, offset + bytes_written);
+  }
+  return bytes_written;
+}
+
+int inode_write(int inum, const char* buf, int n, int64_t offset) {
+  return inode_write_hint(inum, NULL, buf, n, offset);
 }
@@ -7,24 +7,56 @@
 #define INODE_H
 
 #include "blocks.h"
+#include <stdint.h>
 #include <time.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
-#define NUM_INODE_BLOCKS 3
-#define NUM_DIRECT_BLOCKS 12
+#define NUM_INODE_EXTENTS 4
+#define INODE_INLINE_SIZE 60 // regular files up to this size keep their data in the inode
+#define INODE_HOLE_SIZE (1 << 20) // most bytes of a hole one iovec of inode_read_map covers
+
+// inode flags
+#define INODE_INLINE 1 // the data is in inline_data and the file has no blocks
+
+// a run of blocks that are contiguous both in the file and on disk
+typedef struct extent {
+  int file_bnum; // first block of the run within the file
+  int start;     // first block of the run on disk
+  int length;    // number of blocks in the run
+} extent_t;
 
 typedef struct inode {
   int refs;  // reference count
   int mode;  // permission & type
-  int size;  // bytes
-  int num_blocks; // number of blocks in use by this inode
-  int block[NUM_DIRECT_BLOCKS]; // first 12 block numbers (if max file size <= 4K)
-  int indirect_block;
+  int num_blocks; // number of data blocks in use by this inode
+  int extent_depth; // levels of extent tree blocks below the inode, 0 when extent[] holds the extents
+  int extent_count; // number of entries in use in extent[]
+  int index_inum; // for directories, the inode holding the hash index of the entries, otherwise -1
+  int64_t size;  // bytes
+  int flags; // INODE_ flags
+  union {
+    extent_t extent[NUM_INODE_EXTENTS]; // root of the extent tree, sorted by file_bnum
+    char inline_data[INODE_INLINE_SIZE]; // the data of a small regular file, with INODE_INLINE
+  };
   struct timespec access_time;
   struct timespec modification_time;  
 
 } inode_t;
 
+// set up the in-memory inode state once the image is mapped, and free the
+// inodes that were left unlinked but still in use when it was last mounted
+void inode_init();
+
+// the last extent mapped for one user of a file, e.g. an open file handle, so
+// the next access to the same run of blocks doesn't go to the extent tree
+// initialize with all zeros
+typedef struct inode_map_hint {
+  extent_t ext; // the extent, empty when its length is 0
+  uint32_t gen; // the inode's mapping generation ext was looked up in
+  char lock;
+} inode_map_hint_t;
+
 // print the information in the inode to stdout
 // parameter node: pointer to the inode to print 
 void print_inode(inode_t *node);
@@ -38,26 +70,110 @@ inode_t *get_inode(int inum);
 // returns: the inode number or -1 if allocation fails
 int alloc_inode(int mode);
 
-// free the inode with the given number
+// drop a reference to the inode with the given number, freeing it along with
+// its blocks when it was the last one
+// the caller must hold the inode's write lock, unless nothing else can reach it yet
 void free_inode(int inum);
 
-// grow the given inode by the given number of bytes
+// mark the inode as changed, before changing it, so the next commit writes it
+void inode_dirty(inode_t *node);
+
+// check whether the inode changed since the last commit. call inside a
+// transaction, holding the inode's lock
+// returns: 1 if it changed, 0 otherwise
+int inode_changed(int inum);
+
+// record that the inode's number was handed out, e.g. to the kernel in a FUSE
+// lookup, so it must not be freed or reused even if its last link goes away
+// param inum: the inode number
+// param count: the number of references handed out
+void inode_pin(int inum, long count);
+
+// drop references taken by inode_pin, freeing the inode if it was unlinked in the meantime
+// param inum: the inode number
+// param count: the number of references dropped
+void inode_unpin(int inum, long count);
+
+// lock the inode with the given number for reading: several threads can read
+// the inode's data and attributes at once. directories are locked the same way,
+// readers for lookups and listings, writers for adding and removing entries.
+// a thread never holds the locks of two inodes at the same time
+// param inum: the inode number
+void inode_lock_read(int inum);
+
+// lock the inode with the given number for changing its data or attributes
+// param inum: the inode number
+void inode_lock_write(int inum);
+
+// release the lock taken by inode_lock_read or inode_lock_write
+// param inum: the inode number
+void inode_unlock(int inum);
+
+// give the data written to holes of a regular file blocks of its own. it
+// waits in memory until then, with the space for it reserved, and every
+// commit flushes it, so a file written a piece at a time still gets one
+// run of blocks (delayed allocation)
+// the caller holds the inode's write lock inside a transaction
+// returns: 0 if successful, -1 if the extent tree needed a block and the disk is full
+int inode_flush(inode_t *node);
+
+// get the number of the file's blocks that are waiting for inode_flush
+// the caller holds the inode's lock
+int inode_delayed_blocks(int inum);
+
+// grow the given inode by the given number of bytes, which read as zeros.
+// no blocks are allocated for them
 // parameter node: pointer to the input inode
 // parameter size: the number of bytes to increase the inode size by
 // returns: 0 if successful, -1 if unsuccessful
-int grow_inode(inode_t *node, int size);
+int grow_inode(inode_t *node, int64_t size);
 
 // reduce the size of the given inode by the given number of bytes
 // parameter node: pointer to the input inode
 // parameter size: the number of bytes to increase the inode size by
 // returns: 0 if successful, -1 if unsuccessful
-int shrink_inode(inode_t *node, int size);
+int shrink_inode(inode_t *node, int64_t size);
+
+// allocate blocks for the holes in len bytes of the file at offset, in as
+// few runs on disk as the free space allows, so writing there later doesn't
+// allocate anything. the range reads as zeros
+// the caller holds the inode's write lock
+// parameter keep_size: 1 to leave the size alone when the range goes past the end
+// returns: 0 if successful, -1 if the disk is full. blocks allocated before
+//          it filled up stay allocated
+int inode_allocate(inode_t *node, int64_t offset, int64_t len, int keep_size);
+
+// turn len bytes of the file at offset into a hole, freeing the blocks the
+// range covers whole. the size doesn't change
+// the caller holds the inode's write lock
+// returns: 0 if successful, -1 if the extent tree needed a block and the disk is full
+int inode_punch(inode_t *node, int64_t offset, int64_t len);
 
 // get the on disc block number of the given inode at the given offset
 // parameter node: a pointer to the input inode
 // parameter file_bnum: the offset in bytes to find the block of 
 // returns: the block number or -1 if out of range
-int inode_get_bnum(inode_t *node, int offset);
+int inode_get_bnum(inode_t *node, int64_t offset);
+
+// map a block of the file to its block on disc, along with the number of
+// blocks that follow it contiguously on disc
+// parameter node: a pointer to the input inode
+// parameter file_bnum: the index of the block within the file
+// parameter run: output for the length of the contiguous run starting at file_bnum, or of
+//                the hole it is in, may be NULL
+// returns: the block number or -1 if the block is in a hole
+int inode_map(inode_t *node, int file_bnum, int *run);
+
+// find where the data or a hole starts at or after offset, like SEEK_DATA
+// and SEEK_HOLE. the end of the file counts as a hole
+// the caller holds the inode's lock
+// parameter hole: 0 to find data, 1 to find a hole
+// returns: the offset, or -ENXIO if offset is past the end or no data follows it
+int64_t inode_seek(inode_t *node, int64_t offset, int hole);
+
+// check whether memory filled in by inode_read_map is a hole, which is
+// mapped to shared read-only zeros rather than to the image
+int inode_is_hole(const void *addr);
 
 // read up to n bytes into a buffer of the given size, starting from offset in the given inode
 // param inum: the inode number to read from
@@ -66,7 +182,42 @@ int inode_get_bnum(inode_t *node, int offset);
 // param size: the size of the buffer to read into
 // param offset: the offset of the buffer
 // returns: 0 if successful or -1 if unsuccessful;
-int inode_read(int inum, char* buf, int n, int size, int offset);
+int inode_read(int inum, char* buf, int n, int size, int64_t offset);
+
+// read like inode_read, mapping blocks through the hint first
+// the caller holds the inode's lock
+// param hint: the hint to use and update
+int inode_read_hint(int inum, inode_map_hint_t *hint, char* buf, int n, int64_t offset);
+
+// find where up to n bytes of the file starting at offset are in the image's
+// memory, so they can be handed on without copying them out first. each
+// iovec covers a run of blocks that is contiguous on disc
+// the caller holds the inode's lock for as long as it uses the memory
+// param hint: the hint to use and update
+// param iov: output for the pieces of the range
+// param max_iov: the size of iov, the range is cut short when it runs out
+// returns: the number of iovecs filled, or a negative errno
+int inode_read_map(int inum, inode_map_hint_t *hint, int64_t offset, int n, struct iovec *iov, int max_iov);
+
+// allocate the blocks for writing n bytes to the file at offset, and find
+// where they are in the image's memory so the data can be put there directly.
+// any gap before offset is zero filled, but the file only grows to cover
+// the new bytes once they are written and inode_write_done is called
+// the caller holds the inode's write lock until then
+// param hint: the hint to use and update
+// param iov: output for the pieces of the range
+// param max_iov: the size of iov, the range is cut short when it runs out
+// returns: the number of iovecs filled, or a negative errno
+int inode_write_map(int inum, inode_map_hint_t *hint, int64_t offset, int n, struct iovec *iov, int max_iov);
+
+// grow the file to cover bytes put in place through inode_write_map
+// param end: the offset after the last byte written
+void inode_write_done(int inum, int64_t end);
+
+// write like inode_write, mapping blocks through the hint first
+// the caller holds the inode's write lock
+// param hint: the hint to use and update
+int inode_write_hint(int inum, inode_map_hint_t *hint, const char* buf, int n, int64_t offset);
 
 // write up to n bytes into a buffer of the given size, starting from offset in the given inode
 // param inum: the inode number to write to
@@ -74,6 +225,6 @@ int inode_read(int inum, char* buf, int n, int size, int offset);
 // param n: the number of bytes to write
 // param offset: the offset of the buffer
 // returns: 0 if successful or -1 if unsuccessful;
-int inode_write(int inum, const char* buf, int n, int offset);
+int inode_write(int inum, const char* buf, int n, int64_t offset);
 
 #endif
@@ -0,0 +1,603 @@
+// Write-ahead metadata journal
+//
+// The journal region holds one commit: a header with the block numbers of
+// the logged blocks (the tags), followed by their images. A checksum over
+// all of it tells a finished commit from one that was cut off, which is
+// ignored since nothing was written in place yet. A commit only overwrites
+// the region once the blocks the previous one put in place are on disk.
+//
+// Freed blocks are not handed out again until the commit after the one that
+// frees them (see blocks_apply_frees), so a block never holds file data
+// written in place while the image on disk still uses it for something else.
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "log.h"
+
+// bytes of file data that may wait for a commit, they are held in memory
+#define JOURNAL_DATA_MAX (64 << 20)
+// runs of blocks written out together
+#define WRITE_BATCH 64
+
+// the start of the journal region, the tags follow it
+typedef struct journal_header {
+  uint32_t magic;    // JOURNAL_MAGIC, anything else when there is nothing to replay
+  uint32_t count;    // number of blocks logged
+  uint64_t seq;      // number of the commit
+  uint64_t checksum; // of the header with this set to 0, the tags and the images
+} journal_header_t;
+
+static int journal_fd = -1;
+static int64_t journal_pos = 0;  // position of the region in the image file
+static int journal_blocks = 0;   // length of the region
+static int journal_capacity = 0; // most blocks one commit can log
+static int data_limit = 0;       // blocks of data that trigger a commit
+static int can_drop = 0;         // whether blocks are whole pages of memory
+static uint64_t seq = 0;
+static uint64_t epoch = 0; // commits that finished, including empty ones
+
+// a bit per block of the image for each kind of change, and how many are set
+static uint64_t *dirty_meta = NULL;
+static uint64_t *dirty_data = NULL;
+static long meta_count = 0;
+static long data_count = 0;
+static long held_count = 0; // blocks of data held outside the image, see journal_hold
+static void (*flush_held)() = NULL;
+static int set_words = 0;
+static uint64_t *part = NULL; // the blocks of a commit too big for the journal
+// for testing replay, leave the process once a commit is journaled
+static int crash_after_journal = 0;
+
+// held shared by transactions and exclusively by commits, preferring
+// commits so a steady stream of operations can't hold them off
+static pthread_rwlock_t txn_lock;
+static __thread int txn_depth = 0;
+
+static pthread_t committer;
+static int running = 0;
+static int stopping = 0;
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
+
+// get the number of blocks holding the header and n tags
+static int tag_blocks(int n) {
+  return bytes_to_blocks(sizeof(journal_header_t) + (int64_t) n * sizeof(uint32_t));
+}
+
+// checksum len bytes, a multiple of 8, continuing from sum
+static uint64_t checksum(uint64_t sum, const void *data, size_t len) {
+  const uint64_t *words = data;
+  for (size_t ii = 0; ii < len / 8; ii++) {
+    sum = (sum ^ words[ii]) * 0x100000001b3ull;
+    sum ^= sum >> 32;
+  }
+  return sum;
+}
+
+static int write_all(const void *buf, size_t len, int64_t pos) {
+  if (pwrite(journal_fd, buf, len, pos) != (ssize_t) len) {
+    log_error("journal: writing the image failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int sync_image() {
+  if (fdatasync(journal_fd) < 0) {
+    log_error("journal: syncing the image failed: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+// mark the journal as empty, so the next mount doesn't replay it
+static int clear_header() {
+  journal_header_t header;
+  memset(&header, 0, sizeof(header));
+  if (write_all(&header, sizeof(header), journal_pos) < 0) {
+    return -1;
+  }
+  return sync_image();
+}
+
+// get the first block at or after from whose bit in the set is v
+// returns: the block number, or BLOCK_COUNT if there is none
+static int next_bit(uint64_t *set, int from, int v) {
+  int ww = from / 64;
+  if (ww >= set_words) {
+    return BLOCK_COUNT;
+  }
+  uint64_t word = (v ? set[ww] : ~set[ww]) & (~0ull << (from % 64));
+  while (word == 0) {
+    if (++ww >= set_words) {
+      return BLOCK_COUNT;
+    }
+    word = v ? set[ww] : ~set[ww];
+  }
+  int bnum = ww * 64 + __builtin_ctzll(word);
+  return bnum < BLOCK_COUNT ? bnum : BLOCK_COUNT;
+}
+
+static int count_bits(uint64_t *set) {
+  int count = 0;
+  for (int ww = 0; ww < set_words; ww++) {
+    count += __builtin_popcountll(set[ww]);
+  }
+  return count;
+}
+
+// give back the memory of blocks whose contents the image file has, the
+// blocks are read from the file again when they are next used. nothing
+// else may use them meanwhile
+static void drop_blocks(int bnum, int count) {
+  if (can_drop) {
+    blocks_drop(bnum, count);
+  }
+}
+
+// write the blocks in the set to their place in the image, a batch of runs
+// of consecutive blocks at a time
+static int write_home(uint64_t *set) {
+  blocks_run_t runs[WRITE_BATCH];
+  int nn = 0;
+  int bnum = next_bit(set, 0, 1);
+  while (bnum < BLOCK_COUNT) {
+    int end = next_bit(set, bnum, 0);
+    runs[nn++] = (blocks_run_t) {bnum, end - bnum};
+    if (nn == WRITE_BATCH) {
+      if (blocks_write_runs(runs, nn) < 0) {
+        return -1;
+      }
+      nn = 0;
+    }
+    bnum = next_bit(set, end, 1);
+  }
+  return nn > 0 ? blocks_write_runs(runs, nn) : 0;
+}
+
+// clear bits of a set during a commit. the sets and counts are only
+// changed by commits while no transaction runs, but they are read at any time
+static void clear_bits(uint64_t *set, long *count, int ww, uint64_t bits) {
+  bits &= set[ww];
+  if (bits != 0) {
+    __atomic_and_fetch(&set[ww], ~bits, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(count, __builtin_popcountll(bits), __ATOMIC_RELAXED);
+  }
+}
+
+// forget the changes in the set once the image file has them. reads may
+// still be using the blocks
+static void clean(uint64_t *set, long *count) {
+  int bnum = next_bit(set, 0, 1);
+  while (bnum < BLOCK_COUNT) {
+    int end = next_bit(set, bnum, 0);
+    blocks_written(bnum, end - bnum);
+    bnum = next_bit(set, end, 1);
+  }
+  for (int ww = 0; ww < set_words; ww++) {
+    clear_bits(set, count, ww, ~0ull);
+  }
+}
+
+// write the count blocks in the set to the journal and wait for them
+static int write_journal(uint64_t *set, int count) {
+  size_t head_len = (size_t) tag_blocks(count) * BLOCK_SIZE;
+  journal_header_t *header = calloc(1, head_len);
+  struct iovec *iov = malloc(count * sizeof(struct iovec));
+  if (header == NULL || iov == NULL) {
+    free(header);
+    free(iov);
+    log_error("journal: out of memory for commit");
+    return -1;
+  }
+  uint32_t *tags = (uint32_t *) (header + 1);
+  int nn = 0;
+  for (int bnum = next_bit(set, 0, 1); bnum < BLOCK_COUNT;
+       bnum = next_bit(set, bnum + 1, 1)) {
+    tags[nn] = bnum;
+    iov[nn].iov_base = blocks_get_block(bnum);
+    iov[nn].iov_len = BLOCK_SIZE;
+    nn++;
+  }
+  header->magic = JOURNAL_MAGIC;
+  header->count = nn;
+  header->seq = ++seq;
+  uint64_t sum = checksum(0, header, head_len);
+  for (int ii = 0; ii < nn; ii++) {
+    sum = checksum(sum, iov[ii].iov_base, BLOCK_SIZE);
+  }
+  header->checksum = sum;
+
+  int64_t pos = journal_pos;
+  int rv = write_all(header, head_len, pos);
+  pos += head_len;
+  for (int ii = 0; rv == 0 && ii < nn; ii += IOV_MAX) {
+    int batch = nn - ii < IOV_MAX ? nn - ii : IOV_MAX;
+    ssize_t len = (ssize_t) batch * BLOCK_SIZE;
+    if (pwritev(journal_fd, iov + ii, batch, pos) != len) {
+      log_error("journal: writing the journal failed: %s", strerror(errno));
+      rv = -1;
+    }
+    pos += len;
+  }
+  free(header);
+  free(iov);
+  return rv == 0 ? sync_image() : rv;
+}
+
+// put the next count blocks of dirty_meta from the block from on into part
+// returns: the block to continue from
+static int take_part(int from, int count) {
+  memset(part, 0, set_words * sizeof(uint64_t));
+  int bnum = from;
+  for (int ii = 0; ii < count; ii++) {
+    bnum = next_bit(dirty_meta, bnum, 1);
+    part[bnum / 64] |= 1ull << (bnum % 64);
+    bnum++;
+  }
+  return bnum;
+}
+
+// write out everything changed since the last commit. the caller holds
+// txn_lock exclusively. on failure the changes stay marked for the next try
+// returns: 0 if successful, -EIO otherwise
+static int commit_locked() {
+  if (flush_held != NULL) {
+    flush_held();
+  }
+  blocks_apply_frees();
+  if (meta_count == 0 && data_count == 0) {
+    epoch++;
+    return 0;
+  }
+  // blocks reused right after being freed are journaled whatever they hold
+  for (int ww = 0; ww < set_words; ww++) {
+    clear_bits(dirty_data, &data_count, ww, dirty_meta[ww]);
+  }
+  // the data goes in place first, so no committed metadata refers to blocks
+  // that weren't written. the sync also puts the previous commit's blocks
+  // on disk before its journal is overwritten
+  if (write_home(dirty_data) < 0 || sync_image() < 0) {
+    return -EIO;
+  }
+  int count = count_bits(dirty_meta);
+  // rare, e.g. freeing a huge file in one transaction. it goes in as
+  // several commits, each one in place before the next overwrites the
+  // journal, so a crash can leave the later parts undone but never replays
+  // an old commit over newer blocks
+  int split = count > journal_capacity;
+  int from = 0;
+  while (count > 0) {
+    uint64_t *set = dirty_meta;
+    int nn = count < journal_capacity ? count : journal_capacity;
+    if (split) {
+      from = take_part(from, nn);
+      set = part;
+    }
+    if (write_journal(set, nn) < 0) {
+      return -EIO;
+    }
+    if (crash_after_journal) {
+      log_error("journal: stopping after commit %lu as NUFS_CRASH_AFTER_JOURNAL says", seq);
+      _exit(1);
+    }
+    count -= nn;
+    if (write_home(set) < 0 || (count > 0 && sync_image() < 0)) {
+      return -EIO;
+    }
+  }
+  log_trace("journal: commit %lu, %ld metadata blocks, %ld data blocks", seq,
+            meta_count, data_count);
+  clean(dirty_data, &data_count);
+  clean(dirty_meta, &meta_count);
+  epoch++;
+  return 0;
+}
+
+// put the blocks of the last commit in place if it finished writing the
+// journal but the blocks may not all have made it
+static void replay() {
+  journal_header_t header;
+  if (pread(journal_fd, &header, sizeof(header), journal_pos) != sizeof(header) ||
+      header.magic != JOURNAL_MAGIC) {
+    return;
+  }
+  seq = header.seq;
+  if (header.count == 0 || header.count > (uint32_t) journal_capacity) {
+    log_warn("journal: ignoring commit %lu with %u blocks", header.seq, header.count);
+    clear_header();
+    return;
+  }
+  size_t head_len = (size_t) tag_blocks(header.count) * BLOCK_SIZE;
+  size_t len = head_len + (size_t) header.count * BLOCK_SIZE;
+  char *buf = malloc(len);
+  if (buf == NULL) {
+    log_error("journal: out of memory for replaying commit %lu", header.seq);
+    exit(1);
+  }
+  int complete = pread(journal_fd, buf, len, journal_pos) == (ssize_t) len;
+  journal_header_t *copy = (journal_header_t *) buf;
+  copy->checksum = 0;
+  if (!complete || checksum(0, buf, len) != header.checksum) {
+    log_info("journal: discarding incomplete commit %lu", header.seq);
+  } else {
+    uint32_t *tags = (uint32_t *) (copy + 1);
+    for (uint32_t ii = 0; ii < header.count; ii++) {
+      if (tags[ii] == 0 || tags[ii] >= (uint32_t) BLOCK_COUNT) {
+        continue;
+      }
+      if (write_all(buf + head_len + (size_t) ii * BLOCK_SIZE, BLOCK_SIZE,
+                    (int64_t) tags[ii] * BLOCK_SIZE) < 0) {
+        exit(1);
+      }
+    }
+    if (sync_image() < 0) {
+      exit(1);
+    }
+    log_info("journal: replayed commit %lu, %u blocks", header.seq, header.count);
+  }
+  free(buf);
+  // the journal stays for the next mount to try again
+  if (clear_header() < 0) {
+    exit(1);
+  }
+}
+
+void journal_init(int fd, const superblock_t *sb) {
+  journal_fd = fd;
+  journal_pos = (int64_t) sb->journal_start * BLOCK_SIZE;
+  journal_blocks = sb->journal_blocks;
+  journal_capacity = journal_blocks - 1;
+  while (journal_capacity > 0 &&
+         tag_blocks(journal_capacity) + journal_capacity > journal_blocks) {
+    journal_capacity--;
+  }
+  assert(journal_capacity > 0);
+  data_limit = JOURNAL_DATA_MAX / BLOCK_SIZE;
+  if (data_limit > BLOCK_COUNT / 4) {
+    data_limit = BLOCK_COUNT / 4 > 0 ? BLOCK_COUNT / 4 : 1;
+  }
+  can_drop = BLOCK_SIZE % sysconf(_SC_PAGESIZE) == 0;
+
+  set_words = (BLOCK_COUNT + 63) / 64;
+  dirty_meta = calloc(set_words, sizeof(uint64_t));
+  dirty_data = calloc(set_words, sizeof(uint64_t));
+  part = calloc(set_words, sizeof(uint64_t));
+  assert(dirty_meta != NULL && dirty_data != NULL && part != NULL);
+  crash_after_journal = getenv("NUFS_CRASH_AFTER_JOURNAL") != NULL;
+
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  int rv = pthread_rwlock_init(&txn_lock, &attr);
+  assert(rv == 0);
+  pthread_rwlockattr_destroy(&attr);
+
+  replay();
+}
+
+// whether enough has changed that waiting for the commit thread could
+// overflow the journal or hold too much data in memory
+static int journal_full() {
+  return __atomic_load_n(&meta_count, __ATOMIC_RELAXED) * 2 >= journal_capacity ||
+         __atomic_load_n(&data_count, __ATOMIC_RELAXED) +
+         __atomic_load_n(&held_count, __ATOMIC_RELAXED) >= data_limit;
+}
+
+void journal_begin() {
+  if (txn_depth++ == 0) {
+    pthread_rwlock_rdlock(&txn_lock);
+  }
+}
+
+void journal_end() {
+  if (--txn_depth > 0) {
+    return;
+  }
+  pthread_rwlock_unlock(&txn_lock);
+  if (journal_full()) {
+    pthread_rwlock_wrlock(&txn_lock);
+    // another thread may have committed while this one waited
+    if (journal_full()) {
+      commit_locked();
+    }
+    pthread_rwlock_unlock(&txn_lock);
+  }
+}
+
+// mark the blocks holding the range in the set
+static void mark(uint64_t *set, long *count, const void *addr, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  int last = blocks_bnum((const char *) addr + len - 1);
+  for (int bnum = blocks_bnum(addr); bnum <= last; bnum++) {
+    uint64_t bit = 1ull << (bnum % 64);
+    // the same blocks are marked over and over, e.g. the bitmaps, so look
+    // before writing to keep the cache line shared
+    if (__atomic_load_n(&set[bnum / 64], __ATOMIC_RELAXED) & bit) {
+      continue;
+    }
+    if (!(__atomic_fetch_or(&set[bnum / 64], bit, __ATOMIC_RELAXED) & bit)) {
+      __atomic_add_fetch(count, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void journal_dirty(const void *addr, size_t len) {
+  mark(dirty_meta, &meta_count, addr, len);
+}
+
+void journal_dirty_data(const void *addr, size_t len) {
+  mark(dirty_data, &data_count, addr, len);
+}
+
+void journal_hold(long count) {
+  __atomic_add_fetch(&held_count, count, __ATOMIC_RELAXED);
+}
+
+void journal_set_flush(void (*flush)()) {
+  flush_held = flush;
+}
+
+int journal_is_dirty(const void *addr, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  int last = blocks_bnum((const char *) addr + len - 1);
+  for (int bnum = blocks_bnum(addr); bnum <= last; bnum++) {
+    uint64_t bit = 1ull << (bnum % 64);
+    if ((__atomic_load_n(&dirty_meta[bnum / 64], __ATOMIC_RELAXED) |
+         __atomic_load_n(&dirty_data[bnum / 64], __ATOMIC_RELAXED)) & bit) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// A block that was just allocated isn't used by the image on disk (see the
+// top of the file), so the image file can be changed right away. Punching a
+// hole costs nothing per block, where zeroing memory would have every block
+// written at the next commit. Blocks with changes in memory, e.g. ones
+// reused before the commit that frees them, can't be dropped and are zeroed
+// like any other change, as they are when the image's file system can't
+// punch holes.
+void journal_zero(int bnum, int count) {
+  char *addr = blocks_get_new(bnum, count);
+  size_t len = (size_t) count * BLOCK_SIZE;
+  if (can_drop && !journal_is_dirty(addr, len) &&
+      fallocate(journal_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (int64_t) bnum * BLOCK_SIZE, len) == 0) {
+    drop_blocks(bnum, count);
+    return;
+  }
+  journal_dirty_data(addr, len);
+  memset(addr, 0, len);
+}
+
+// called by blocks_apply_frees during a commit
+void journal_forget(int bnum, int count) {
+  for (int ii = bnum; ii < bnum + count; ii++) {
+    uint64_t bit = 1ull << (ii % 64);
+    clear_bits(dirty_meta, &meta_count, ii / 64, bit);
+    clear_bits(dirty_data, &data_count, ii / 64, bit);
+  }
+  drop_blocks(bnum, count);
+}
+
+int journal_commit() {
+  assert(txn_depth == 0);
+  pthread_rwlock_wrlock(&txn_lock);
+  int rv = commit_locked();
+  pthread_rwlock_unlock(&txn_lock);
+  return rv;
+}
+
+uint64_t journal_epoch() {
+  return epoch;
+}
+
+// whether the block has file data the image file doesn't, read atomically
+// since other transactions mark blocks in the same word
+static int data_bit(int bnum) {
+  return __atomic_load_n(&dirty_data[bnum / 64], __ATOMIC_RELAXED) >> (bnum % 64) & 1;
+}
+
+// Commits can't run during the caller's transaction, and nothing else
+// changes these blocks while the caller holds its lock, so their bits can be
+// cleared here. Other transactions may set bits in the same words meanwhile,
+// hence the atomics.
+int journal_sync_data(const struct iovec *iov, int count) {
+  assert(txn_depth > 0);
+  blocks_run_t runs[WRITE_BATCH];
+  int nn = 0;
+  for (int ii = 0; ii < count; ii++) {
+    int bnum = blocks_bnum(iov[ii].iov_base);
+    int last = blocks_bnum((char *) iov[ii].iov_base + iov[ii].iov_len - 1);
+    while (bnum <= last) {
+      int end = bnum;
+      while (end <= last && data_bit(end)) {
+        end++;
+      }
+      if (end > bnum) {
+        runs[nn++] = (blocks_run_t) {bnum, end - bnum};
+      }
+      if (nn == WRITE_BATCH) {
+        if (blocks_write_runs(runs, nn) < 0) {
+          return -EIO;
+        }
+        nn = 0;
+      }
+      bnum = end + 1;
+    }
+  }
+  if ((nn > 0 && blocks_write_runs(runs, nn) < 0) || sync_image() < 0) {
+    return -EIO;
+  }
+  for (int ii = 0; ii < count; ii++) {
+    int first = blocks_bnum(iov[ii].iov_base);
+    int last = blocks_bnum((char *) iov[ii].iov_base + iov[ii].iov_len - 1);
+    for (int bnum = first; bnum <= last; bnum++) {
+      uint64_t bit = 1ull << (bnum % 64);
+      if (__atomic_fetch_and(&dirty_data[bnum / 64], ~bit, __ATOMIC_RELAXED) & bit) {
+        __atomic_sub_fetch(&data_count, 1, __ATOMIC_RELAXED);
+        blocks_written(bnum, 1);
+      }
+    }
+  }
+  return 0;
+}
+
+static void *commit_thread(void *arg) {
+  (void) arg;
+  pthread_mutex_lock(&stop_lock);
+  while (!stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += JOURNAL_COMMIT_INTERVAL;
+    pthread_cond_timedwait(&stop_cond, &stop_lock, &ts);
+    if (stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&stop_lock);
+    journal_commit();
+    pthread_mutex_lock(&stop_lock);
+  }
+  pthread_mutex_unlock(&stop_lock);
+  return NULL;
+}
+
+void journal_start() {
+  stopping = 0;
+  int rv = pthread_create(&committer, NULL, commit_thread, NULL);
+  assert(rv == 0);
+  running = 1;
+}
+
+void journal_stop() {
+  if (running) {
+    pthread_mutex_lock(&stop_lock);
+    stopping = 1;
+    pthread_cond_signal(&stop_cond);
+    pthread_mutex_unlock(&stop_lock);
+    pthread_join(committer, NULL);
+    running = 0;
+  }
+  journal_commit();
+  // once the last commit's blocks are on disk the journal has nothing to add
+  if (meta_count == 0 && data_count == 0 && sync_image() == 0) {
+    clear_header();
+  }
+}
@@ -0,0 +1,100 @@
+// Write-ahead journal for the metadata of the image.
+//
+// The image is mapped privately, so changes stay in memory until a commit
+// writes them to the image file. Every storage operation runs in a
+// transaction, and a commit waits for the running ones to finish and writes
+// out everything they changed at once, so many small operations share one
+// sync (group commit).
+//
+// A commit first writes the changed file data to its place in the image,
+// then the changed metadata blocks (bitmaps, inodes, extent tree blocks and
+// directories) to the journal region, and only once that is on disk to their
+// place. If the file system stops before it gets there, the next mount
+// replays the journal, so the metadata on disk is always that of some commit
+// and never refers to data that was not written.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "blocks.h"
+
+#define JOURNAL_MAGIC 0x4a46554e // "NUFJ"
+#define JOURNAL_COMMIT_INTERVAL 5 // seconds between commits of the background thread
+
+// replay the journal of the image if the last commit didn't finish, and set
+// up the in-memory state. called by blocks_init before the image is mapped
+// param fd: the image file
+// param sb: the superblock of the image
+void journal_init(int fd, const superblock_t *sb);
+
+// start a transaction. changes made until the matching journal_end are
+// committed together. transactions nest, only the outermost counts
+void journal_begin();
+
+// end a transaction, committing if enough has changed since the last commit
+void journal_end();
+
+// mark metadata in the mapped image as changed, before changing it
+// param addr: the first byte that changes
+// param len: the number of bytes that change
+void journal_dirty(const void *addr, size_t len);
+
+// mark file data in the mapped image as changed, before changing it. data
+// isn't journaled, it is written in place before the metadata that refers
+// to it is committed
+void journal_dirty_data(const void *addr, size_t len);
+
+// count blocks of file data held outside the image until the next commit
+// puts them in place, so that too many of them start a commit the way
+// changed blocks do
+// param count: the number of blocks added, negative for blocks put in place
+void journal_hold(long count);
+
+// set the function that puts held data in place and trims what is cached
+// in memory. it runs at the start of every commit, while no transaction does
+void journal_set_flush(void (*flush)());
+
+// check whether a range of the mapped image has changes the image file doesn't have yet
+// returns: 1 if any block in the range is changed, 0 otherwise
+int journal_is_dirty(const void *addr, size_t len);
+
+// clear blocks that were just allocated for file data, which the image
+// file may still hold old data in. call inside a transaction
+// param bnum: the first block
+// param count: the number of blocks
+void journal_zero(int bnum, int count);
+
+// drop the changes to blocks that were freed, they don't need to be written
+// param bnum: the first block freed
+// param count: the number of blocks freed
+void journal_forget(int bnum, int count);
+
+// commit everything changed so far, waiting for running transactions to
+// end. must not be called inside a transaction
+// returns: 0 if successful, -EIO if writing the image failed
+int journal_commit();
+
+// get the number of commits so far, which doesn't change during a transaction.
+// changes made in one are written by commit journal_epoch() + 1
+uint64_t journal_epoch();
+
+// write the changed file data in the given ranges to its place in the image
+// and wait for it, without a commit. only for data the committed metadata
+// already points at. call inside a transaction, holding a lock that keeps
+// the data from changing
+// param iov: the ranges of the mapped image
+// param count: the number of ranges
+// returns: 0 if successful, -EIO if writing the image failed
+int journal_sync_data(const struct iovec *iov, int count);
+
+// start the thread committing every JOURNAL_COMMIT_INTERVAL seconds. until
+// then commits only happen when the journal fills up or journal_commit is
+// called. call after daemonizing, the thread would be lost in the fork
+void journal_start();
+
+// stop the commit thread, commit what is left and mark the journal as empty
+void journal_stop();
+
+#endif
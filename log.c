@@ -0,0 +1,195 @@
+// Leveled logging
+//
+// The queue is a bounded multi producer, single consumer ring. Each slot has
+// a sequence number telling whose turn it is: a producer claims the slot at
+// position pos by moving the tail past it, when the slot's sequence is pos,
+// and hands it to the writer by setting it to pos + 1. The writer gives it
+// back for the next lap by setting it to pos + LOG_SLOTS. When the ring is
+// full messages are dropped and counted rather than making a request wait.
+//
+// The writer sleeps on a condition variable once the ring is empty. It says
+// so in sleeping before checking the ring one last time, and a producer that
+// publishes a message looks at sleeping after, so one of them always sees
+// the other. Producers only take the lock to wake the writer up.
+//
+// log_stop closes the ring by setting LOG_CLOSED in the tail, so producers
+// that come after write directly, and then waits for the messages already
+// claimed to be published before writing them out.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include "log.h"
+
+#define LOG_SLOTS 1024 // must be a power of two
+#define LOG_LINE 256   // longer messages are cut short
+#define LOG_CLOSED (1ul << 63)
+
+typedef struct log_slot {
+  unsigned long seq;
+  char line[LOG_LINE];
+} log_slot_t;
+
+static log_slot_t ring[LOG_SLOTS];
+static unsigned long tail = 0; // next position producers claim
+static unsigned long head = 0; // next position the writer takes, writer only
+static long dropped = 0;
+static int running = 0;
+static int sleeping = 0; // the writer is or is about to be waiting on wake
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+
+// format the message into the given buffer, always ending it with a newline
+static void format_line(char *line, const char *fmt, va_list ap) {
+  int len = vsnprintf(line, LOG_LINE - 1, fmt, ap);
+  if (len < 0) {
+    len = 0;
+  } else if (len > LOG_LINE - 2) {
+    len = LOG_LINE - 2;
+  }
+  line[len] = '\n';
+  line[len + 1] = '\0';
+}
+
+// claim a slot for a message
+// param pos: output for the position of the slot, LOG_CLOSED if the ring is
+// closed
+// returns: the slot, or NULL if the ring is full or closed
+static log_slot_t *claim_slot(unsigned long *pos) {
+  unsigned long ii = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+  for (;;) {
+    if (ii & LOG_CLOSED) {
+      *pos = LOG_CLOSED;
+      return NULL;
+    }
+    log_slot_t *slot = &ring[ii & (LOG_SLOTS - 1)];
+    long dif = (long) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - ii);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&tail, &ii, ii + 1, 1, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        *pos = ii;
+        return slot;
+      }
+      // the failed exchange loaded the current tail into ii
+    } else if (dif < 0) {
+      // the writer hasn't emptied this slot since the last lap
+      *pos = ii;
+      return NULL;
+    } else {
+      ii = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// wake the writer if it is waiting for messages
+static void wake_writer() {
+  if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+  }
+}
+
+void log_write(int level, const char *fmt, ...) {
+  (void) level; // the macros in log.h already filtered by it
+  va_list ap;
+  va_start(ap, fmt);
+  unsigned long pos = LOG_CLOSED;
+  log_slot_t *slot = NULL;
+  if (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    slot = claim_slot(&pos);
+  }
+  if (pos == LOG_CLOSED) {
+    char line[LOG_LINE];
+    format_line(line, fmt, ap);
+    fputs(line, stdout);
+  } else if (slot == NULL) {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+  } else {
+    format_line(slot->line, fmt, ap);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+  }
+  va_end(ap);
+}
+
+// write out every message that is ready
+// returns: the number of messages written
+static int drain() {
+  int count = 0;
+  for (;;) {
+    log_slot_t *slot = &ring[head & (LOG_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head + 1) {
+      break;
+    }
+    fputs(slot->line, stdout);
+    __atomic_store_n(&slot->seq, head + LOG_SLOTS, __ATOMIC_RELEASE);
+    head++;
+    count++;
+  }
+  long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (lost > 0) {
+    printf("log: dropped %ld messages\n", lost);
+  }
+  if (count > 0 || lost > 0) {
+    fflush(stdout);
+  }
+  return count;
+}
+
+static void *writer_main(void *arg) {
+  (void) arg;
+  while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    if (drain() > 0) {
+      continue;
+    }
+    pthread_mutex_lock(&wake_lock);
+    __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+    log_slot_t *slot = &ring[head & (LOG_SLOTS - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != head + 1 &&
+        __atomic_load_n(&running, __ATOMIC_SEQ_CST)) {
+      pthread_cond_wait(&wake, &wake_lock);
+    }
+    __atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&wake_lock);
+  }
+  drain();
+  return NULL;
+}
+
+void log_start() {
+  if (running) {
+    return;
+  }
+  for (unsigned long ii = 0; ii < LOG_SLOTS; ii++) {
+    ring[ii].seq = head + ii;
+  }
+  tail = head;
+  fflush(stdout);
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+    // keep writing directly
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  }
+}
+
+void log_stop() {
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  __atomic_store_n(&running, 0, __ATOMIC_SEQ_CST);
+  unsigned long end = __atomic_fetch_or(&tail, LOG_CLOSED, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&wake_lock);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&wake_lock);
+  pthread_join(writer, NULL);
+  // threads that claimed a slot just before the ring was closed may not have
+  // published their message yet
+  while (head != end) {
+    if (drain() == 0) {
+      sched_yield();
+    }
+  }
+}
@@ -0,0 +1,53 @@
+// Leveled logging.
+//
+// Messages above NUFS_LOG_LEVEL are compiled out entirely: the arguments are
+// still type checked against the format, but nothing is evaluated, formatted
+// or called. Build with a higher level (make LOG_LEVEL=LOG_TRACE) to see the
+// per operation traces.
+//
+// Once log_start has been called, enabled messages are put on a lock-free
+// ring and written out by a separate thread, so threads serving requests
+// never wait on the terminal. Before that (and after log_stop) they are
+// written directly.
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3 // one line per file system operation
+#define LOG_TRACE 4 // storage engine internals
+
+#ifndef NUFS_LOG_LEVEL
+#define NUFS_LOG_LEVEL LOG_INFO
+#endif
+
+// log a message, use the macros below instead so disabled levels compile out
+// param level: the level of the message
+// param fmt: printf style format, without the trailing newline
+void log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if ((level) <= NUFS_LOG_LEVEL) {                                           \
+      log_write((level), __VA_ARGS__);                                         \
+    }                                                                          \
+  } while (0)
+
+#define log_error(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LOG_TRACE, __VA_ARGS__)
+
+// start the thread that writes out queued messages
+// called from the frontends' init, after FUSE has daemonized, since threads
+// don't survive the fork
+void log_start();
+
+// write out everything still queued and stop the writer thread
+void log_stop();
+
+#endif
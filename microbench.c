@@ -0,0 +1,301 @@
+// In-process microbenchmarks of the storage engine.
+//
+// Links the engine without FUSE, so the numbers are what the file system
+// itself costs, without kernel round trips. Each run formats a fresh image.
+//
+//   ./microbench [-s image_mb] [-f fanout] [-d depth] [-m io_mb]
+//                [-b io_size] [-n iterations] [-B backend] [image]
+//
+// -B picks the block backend (mmap, pread or direct, see blocks.h). The
+// cold reads show where each one wins: they start with nothing of the file
+// in memory, neither the engine's nor the kernel's page cache.
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "directory.h"
+#include "inode.h"
+#include "blocks.h"
+#include "dcache.h"
+#include "journal.h"
+
+typedef struct bench_config {
+  int64_t image_mb;
+  int fanout;     // entries in the directory used for the directory benchmarks
+  int depth;      // directories above the file looked up by get_inum
+  int64_t io_mb;  // size of the file used for the read/write benchmarks
+  int io_size;    // bytes per inode_read/inode_write call
+  int iterations; // alloc_block calls and get_inum lookups
+  const char *backend;
+  const char *image;
+} bench_config_t;
+
+static int64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *name, long ops, int64_t ns, int64_t bytes) {
+  double secs = ns / 1e9;
+  printf("%-20s %10ld ops %10.1f ns/op %12.0f ops/s", name, ops,
+         ops ? (double) ns / ops : 0.0, ops / secs);
+  if (bytes > 0) {
+    printf(" %9.1f MB/s", bytes / secs / (1 << 20));
+  }
+  printf("\n");
+}
+
+// commit what a benchmark changed, which a mounted file system pays for too.
+// the engine functions called directly run outside any transaction, so
+// nothing commits on its own until here
+static void bench_commit(const char *name) {
+  int64_t start = now_ns();
+  journal_commit();
+  report(name, 1, now_ns() - start, 0);
+}
+
+// start from a freshly formatted image of the configured size
+static void make_image(bench_config_t *cfg) {
+  unlink(cfg->image);
+  int fd = open(cfg->image, O_CREAT | O_RDWR, 0644);
+  assert(fd != -1);
+  int rv = ftruncate(fd, cfg->image_mb << 20);
+  assert(rv == 0);
+  close(fd);
+  storage_init(cfg->image);
+}
+
+static void bench_alloc_block(bench_config_t *cfg) {
+  int *bnums = malloc(cfg->iterations * sizeof(int));
+  int count = 0;
+
+  int64_t start = now_ns();
+  while (count < cfg->iterations) {
+    int bnum = alloc_block();
+    if (bnum < 0) {
+      break;
+    }
+    bnums[count++] = bnum;
+  }
+  report("alloc_block", count, now_ns() - start, 0);
+
+  start = now_ns();
+  for (int ii = 0; ii < count; ++ii) {
+    free_block(bnums[ii]);
+  }
+  report("free_block", count, now_ns() - start, 0);
+  free(bnums);
+}
+
+// put the image's data blocks out of memory, so the next reads go to the
+// disk. nothing else runs, so the blocks can be dropped under the engine
+static void drop_caches(bench_config_t *cfg) {
+  superblock_t *sb = get_superblock();
+  blocks_drop(sb->data_start, BLOCK_COUNT - sb->data_start);
+  int fd = open(cfg->image, O_RDONLY);
+  assert(fd != -1);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void bench_inode_io(bench_config_t *cfg) {
+  int inum = storage_mknod_at(0, "io", 0100644);
+  assert(inum > 0);
+  char *buf = malloc(cfg->io_size);
+  memset(buf, 'x', cfg->io_size);
+  long count = (cfg->io_mb << 20) / cfg->io_size;
+  int64_t bytes = count * cfg->io_size;
+
+  int64_t start = now_ns();
+  for (long ii = 0; ii < count; ++ii) {
+    int rv = inode_write(inum, buf, cfg->io_size, ii * cfg->io_size);
+    assert(rv == cfg->io_size);
+  }
+  report("inode_write seq", count, now_ns() - start, bytes);
+
+  start = now_ns();
+  for (long ii = 0; ii < count; ++ii) {
+    int rv = inode_read(inum, buf, cfg->io_size, cfg->io_size, ii * cfg->io_size);
+    assert(rv == cfg->io_size);
+  }
+  report("inode_read seq", count, now_ns() - start, bytes);
+
+  int64_t *offsets = malloc(count * sizeof(int64_t));
+  for (long ii = 0; ii < count; ++ii) {
+    offsets[ii] = (int64_t) (rand() % count) * cfg->io_size;
+  }
+  start = now_ns();
+  for (long ii = 0; ii < count; ++ii) {
+    inode_read(inum, buf, cfg->io_size, cfg->io_size, offsets[ii]);
+  }
+  report("inode_read rand", count, now_ns() - start, bytes);
+
+  // the cold reads need the data on disk
+  bench_commit("commit inode_write");
+  drop_caches(cfg);
+  start = now_ns();
+  for (long ii = 0; ii < count; ++ii) {
+    int rv = inode_read(inum, buf, cfg->io_size, cfg->io_size, ii * cfg->io_size);
+    assert(rv == cfg->io_size);
+  }
+  report("inode_read cold seq", count, now_ns() - start, bytes);
+
+  drop_caches(cfg);
+  start = now_ns();
+  for (long ii = 0; ii < count; ++ii) {
+    inode_read(inum, buf, cfg->io_size, cfg->io_size, offsets[ii]);
+  }
+  report("inode_read cold rand", count, now_ns() - start, bytes);
+
+  start = now_ns();
+  for (long ii = 0; ii < count; ++ii) {
+    inode_write(inum, buf, cfg->io_size, offsets[ii]);
+  }
+  report("inode_write rand", count, now_ns() - start, bytes);
+
+  free(offsets);
+  free(buf);
+  storage_unlink("/io");
+}
+
+static void bench_directory(bench_config_t *cfg) {
+  char name[DIR_NAME_LENGTH];
+  int dir = storage_mknod_at(0, "fan", 040755);
+  assert(dir > 0);
+
+  int64_t start = now_ns();
+  for (int ii = 0; ii < cfg->fanout; ++ii) {
+    snprintf(name, sizeof(name), "entry_%d", ii);
+    int rv = directory_put(dir, name, 0100644);
+    assert(rv > 0);
+  }
+  report("directory_put", cfg->fanout, now_ns() - start, 0);
+
+  // look every entry up in a random order, twice, so the second pass shows
+  // what the dentry cache saves when the entries fit in it
+  int *order = malloc(cfg->fanout * sizeof(int));
+  for (int ii = 0; ii < cfg->fanout; ++ii) {
+    order[ii] = ii;
+  }
+  for (int ii = cfg->fanout - 1; ii > 0; --ii) {
+    int jj = rand() % (ii + 1);
+    int tmp = order[ii];
+    order[ii] = order[jj];
+    order[jj] = tmp;
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    long hits0, misses0, hits, misses;
+    dcache_stats(&hits0, &misses0);
+    start = now_ns();
+    for (int ii = 0; ii < cfg->fanout; ++ii) {
+      snprintf(name, sizeof(name), "entry_%d", order[ii]);
+      int rv = directory_lookup(dir, name);
+      assert(rv > 0);
+    }
+    report(pass ? "directory_lookup 2" : "directory_lookup 1", cfg->fanout,
+           now_ns() - start, 0);
+    dcache_stats(&hits, &misses);
+    printf("%-20s %10ld hits %10ld misses\n", "  dcache", hits - hits0,
+           misses - misses0);
+  }
+
+  start = now_ns();
+  for (int ii = 0; ii < cfg->fanout; ++ii) {
+    snprintf(name, sizeof(name), "entry_%d", order[ii]);
+    int rv = directory_delete(dir, name);
+    assert(rv == 0);
+  }
+  report("directory_delete", cfg->fanout, now_ns() - start, 0);
+  free(order);
+}
+
+static void bench_get_inum(bench_config_t *cfg) {
+  char *path = malloc(cfg->depth * 8 + 16);
+  int dir = 0;
+  path[0] = '\0';
+  for (int ii = 0; ii < cfg->depth; ++ii) {
+    char name[DIR_NAME_LENGTH];
+    snprintf(name, sizeof(name), "d%d", ii);
+    dir = storage_mknod_at(dir, name, 040755);
+    assert(dir > 0);
+    strcat(path, "/");
+    strcat(path, name);
+  }
+  int leaf = storage_mknod_at(dir, "leaf", 0100644);
+  assert(leaf > 0);
+  strcat(path, "/leaf");
+
+  int64_t start = now_ns();
+  for (int ii = 0; ii < cfg->iterations; ++ii) {
+    int rv = get_inum(path);
+    assert(rv == leaf);
+  }
+  report("get_inum", cfg->iterations, now_ns() - start, 0);
+  free(path);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-s image_mb] [-f fanout] [-d depth] [-m io_mb] "
+          "[-b io_size] [-n iterations] [-B backend] [image]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  bench_config_t cfg = {
+    .image_mb = 256,
+    .fanout = 10000,
+    .depth = 16,
+    .io_mb = 64,
+    .io_size = 4096,
+    .iterations = 100000,
+    .image = "microbench.nufs",
+  };
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:f:d:m:b:n:B:")) != -1) {
+    switch (opt) {
+    case 's': cfg.image_mb = atol(optarg); break;
+    case 'f': cfg.fanout = atoi(optarg); break;
+    case 'd': cfg.depth = atoi(optarg); break;
+    case 'm': cfg.io_mb = atol(optarg); break;
+    case 'b': cfg.io_size = atoi(optarg); break;
+    case 'n': cfg.iterations = atoi(optarg); break;
+    case 'B': cfg.backend = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind < argc) {
+    cfg.image = argv[optind];
+  }
+  if (cfg.image_mb <= 0 || cfg.fanout <= 0 || cfg.depth <= 0 ||
+      cfg.io_mb <= 0 || cfg.io_size <= 0 || cfg.iterations <= 0) {
+    usage(argv[0]);
+  }
+
+  // the engine reads it in blocks_init
+  if (cfg.backend != NULL) {
+    setenv("NUFS_BACKEND", cfg.backend, 1);
+  }
+  srand(1);
+  make_image(&cfg);
+  bench_alloc_block(&cfg);
+  bench_commit("commit alloc");
+  bench_inode_io(&cfg);
+  bench_commit("commit inode_io");
+  bench_directory(&cfg);
+  bench_commit("commit directory");
+  bench_get_inum(&cfg);
+  storage_stop();
+  return 0;
+}
@@ -0,0 +1,17 @@
+// ioctl commands of nufs files, for programs using a mounted file system.
+//
+// FUSE 2.9 doesn't pass lseek on to file systems, so SEEK_DATA and SEEK_HOLE
+// are ioctls instead. The argument is an int64_t holding the offset to
+// search from, which is replaced with the offset found. They fail with
+// ENXIO where lseek would.
+
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define NUFS_IOC_SEEK_DATA _IOWR('N', 1, int64_t)
+#define NUFS_IOC_SEEK_HOLE _IOWR('N', 2, int64_t)
+
+#endif
@@ -0,0 +1,495 @@
+// Low level FUSE frontend for the nufs file system.
+//
+// The kernel refers to files by inode number instead of by path, so no
+// request needs to walk a path again. FUSE inode numbers are our inode
+// numbers plus one, since FUSE reserves 1 (FUSE_ROOT_ID) for the root and ours
+// is 0. Every entry handed to the kernel pins the inode until the kernel
+// forgets it, so an open file that is unlinked stays readable.
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/falloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "storage.h"
+#include "directory.h"
+#include "inode.h"
+#include "dcache.h"
+#include "log.h"
+#include "nufs_ioctl.h"
+
+// how long the kernel may cache attributes and names, in seconds
+#define NUFS_TIMEOUT 1.0
+
+static int to_inum(fuse_ino_t ino) {
+  return (int) ino - 1;
+}
+
+static fuse_ino_t to_ino(int inum) {
+  return (fuse_ino_t) inum + 1;
+}
+
+// reply to a request for an entry with its attributes
+// the inode must already be pinned for the kernel's new reference
+static void reply_entry(fuse_req_t req, int inum) {
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  if (storage_stat_inum(inum, &e.attr) < 0) {
+    storage_unpin(inum, 1);
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  e.ino = to_ino(inum);
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = NUFS_TIMEOUT;
+  e.entry_timeout = NUFS_TIMEOUT;
+  fuse_reply_entry(req, &e);
+}
+
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int inum = directory_lookup_pin(to_inum(parent), name);
+  log_debug("lookup(%lu, %s) -> %d", parent, name, inum);
+  if (inum < 0) {
+    fuse_reply_err(req, -inum);
+    return;
+  }
+  reply_entry(req, inum);
+}
+
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  storage_unpin(to_inum(ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; i++) {
+    storage_unpin(to_inum(forgets[i].ino), forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  (void) fi;
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  int rv = storage_stat_inum(to_inum(ino), &st);
+  log_debug("getattr(%lu) -> %d", ino, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  st.st_ino = ino;
+  fuse_reply_attr(req, &st, NUFS_TIMEOUT);
+}
+
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  int inum = to_inum(ino);
+  int rv = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    rv = storage_truncate_inum(inum, attr->st_size);
+  }
+  if (rv == 0 && to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+    struct stat st;
+    storage_stat_inum(inum, &st);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timespec ts[2] = {st.st_atim, st.st_mtim};
+    if (to_set & FUSE_SET_ATTR_ATIME) {
+      ts[0] = to_set & FUSE_SET_ATTR_ATIME_NOW ? now : attr->st_atim;
+    }
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+      ts[1] = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : attr->st_mtim;
+    }
+    rv = storage_set_time_inum(inum, ts);
+  }
+  log_debug("setattr(%lu, %x) -> %d", ino, to_set, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  nufs_ll_getattr(req, ino, fi);
+}
+
+// the reply buffer readdir fills
+typedef struct readdir_buf {
+  fuse_req_t req;
+  char *data;
+  size_t size; // capacity of data
+  size_t used; // bytes of data filled
+} readdir_buf_t;
+
+// add an entry to the readdir reply, stopping once it is full
+static int fill_dir(void *buf, const char *name, const struct stat *st, off_t offset) {
+  readdir_buf_t *rb = buf;
+  struct stat entry_st = *st;
+  entry_st.st_ino = to_ino(st->st_ino);
+  size_t len = fuse_add_direntry(rb->req, rb->data + rb->used, rb->size - rb->used,
+                                 name, &entry_st, offset);
+  if (len > rb->size - rb->used) {
+    return 1;
+  }
+  rb->used += len;
+  return 0;
+}
+
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                            struct fuse_file_info *fi) {
+  (void) fi;
+  int inum = to_inum(ino);
+  if (!(get_inode(inum)->mode & 040000)) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+  readdir_buf_t rb = {req, malloc(size), size, 0};
+  if (rb.data == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  directory_readdir(inum, &rb, fill_dir, off);
+  log_debug("readdir(%lu, @%ld) -> %ld bytes", ino, off, rb.used);
+  fuse_reply_buf(req, rb.data, rb.used);
+  free(rb.data);
+}
+
+// create an object and reply with its entry
+static void make_node(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  int rv = storage_mknod_at(to_inum(parent), name, mode);
+  log_debug("mknod(%lu, %s, %04o) -> %d", parent, name, mode, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  // looked up again to pin it, it may already be gone if it was removed in between
+  int inum = directory_lookup_pin(to_inum(parent), name);
+  if (inum < 0) {
+    fuse_reply_err(req, -inum);
+    return;
+  }
+  reply_entry(req, inum);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  (void) rdev;
+  make_node(req, parent, name, mode);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  make_node(req, parent, name, mode | 040000);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_unlink_at(to_inum(parent), name);
+  log_debug("unlink(%lu, %s) -> %d", parent, name, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  int rv = storage_rmdir_at(to_inum(parent), name);
+  log_debug("rmdir(%lu, %s) -> %d", parent, name, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+  int rv = storage_rename_at(to_inum(parent), name, to_inum(newparent), newname);
+  log_debug("rename(%lu, %s => %lu, %s) -> %d", parent, name, newparent, newname, rv);
+  fuse_reply_err(req, -rv);
+}
+
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname) {
+  int inum = to_inum(ino);
+  int rv = storage_link_at(to_inum(newparent), newname, inum);
+  log_debug("link(%lu => %lu, %s) -> %d", ino, newparent, newname, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  // the kernel already holds the inode, so it can't be freed before this
+  inode_pin(inum, 1);
+  reply_entry(req, inum);
+}
+
+// get the handle stored in fh by open or create
+static storage_file_t *get_file(struct fuse_file_info *fi) {
+  return (storage_file_t *) (uintptr_t) fi->fh;
+}
+
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  storage_file_t *file;
+  int rv = storage_open_inum(to_inum(ino), &file);
+  log_debug("open(%lu) -> %d", ino, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fi->fh = (uintptr_t) file;
+  if (fuse_reply_open(req, fi) < 0) {
+    // the open was interrupted, so there won't be a release
+    storage_close(file);
+  }
+}
+
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi) {
+  int rv = storage_mknod_at(to_inum(parent), name, mode);
+  log_debug("create(%lu, %s, %04o) -> %d", parent, name, mode, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  int inum = directory_lookup_pin(to_inum(parent), name);
+  if (inum < 0) {
+    fuse_reply_err(req, -inum);
+    return;
+  }
+  storage_file_t *file;
+  rv = storage_open_inum(inum, &file);
+  if (rv < 0) {
+    storage_unpin(inum, 1);
+    fuse_reply_err(req, -rv);
+    return;
+  }
+  fi->fh = (uintptr_t) file;
+
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  storage_stat_inum(inum, &e.attr);
+  e.ino = to_ino(inum);
+  e.attr.st_ino = e.ino;
+  e.attr_timeout = NUFS_TIMEOUT;
+  e.entry_timeout = NUFS_TIMEOUT;
+  if (fuse_reply_create(req, &e, fi) < 0) {
+    storage_close(file);
+    storage_unpin(inum, 1);
+  }
+}
+
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  (void) ino;
+  storage_close(get_file(fi));
+  fuse_reply_err(req, 0);
+}
+
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  (void) ino;
+  (void) datasync;
+  fuse_reply_err(req, -storage_file_sync(get_file(fi)));
+}
+
+static void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  (void) ino;
+  (void) datasync;
+  (void) fi;
+  fuse_reply_err(req, -storage_sync());
+}
+
+// preallocation and hole punching, like nufs_fallocate
+static void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                              off_t length, struct fuse_file_info *fi) {
+  (void) ino;
+  int rv = -EOPNOTSUPP;
+  if (mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+    rv = storage_file_punch(get_file(fi), offset, length);
+  } else if ((mode & ~FALLOC_FL_KEEP_SIZE) == 0) {
+    rv = storage_file_allocate(get_file(fi), offset, length, mode & FALLOC_FL_KEEP_SIZE);
+  }
+  fuse_reply_err(req, -rv);
+}
+
+// the SEEK_DATA and SEEK_HOLE ioctls, see nufs_ioctl.h
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags,
+                          const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+  (void) ino;
+  (void) arg;
+  (void) flags;
+  (void) out_bufsz;
+  unsigned int ucmd = cmd;
+  if ((ucmd != NUFS_IOC_SEEK_DATA && ucmd != NUFS_IOC_SEEK_HOLE) ||
+      in_bufsz != sizeof(int64_t)) {
+    fuse_reply_err(req, ENOTTY);
+    return;
+  }
+  int64_t pos = storage_file_seek(get_file(fi), *(const int64_t *) in_buf,
+                                  ucmd == NUFS_IOC_SEEK_HOLE);
+  if (pos < 0) {
+    fuse_reply_err(req, -pos);
+  } else {
+    fuse_reply_ioctl(req, 0, &pos, sizeof(pos));
+  }
+}
+
+// reply with the data straight from the image's memory, holding the
+// file's read lock until it has been sent
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi) {
+  storage_file_t *file = get_file(fi);
+  int max = storage_file_map_max(size);
+  struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  struct iovec *iov = malloc(max * sizeof(struct iovec));
+  if (bufv == NULL || iov == NULL) {
+    free(bufv);
+    free(iov);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int count = storage_file_map(file, off, size, iov, max);
+  log_debug("read(%lu, %ld bytes, @+%ld) -> %d pieces", ino, size, off, count);
+  if (count < 0) {
+    fuse_reply_err(req, -count);
+  } else {
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = count == 0 ? 1 : count;
+    for (int i = 0; i < count; i++) {
+      bufv->buf[i] = bufv->buf[0];
+      bufv->buf[i].mem = iov[i].iov_base;
+      bufv->buf[i].size = iov[i].iov_len;
+    }
+    // the pages belong to the live mapping, so they are never gifted to the kernel
+    fuse_reply_data(req, bufv, 0);
+    storage_file_unmap(file);
+  }
+  free(bufv);
+  free(iov);
+}
+
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                          off_t off, struct fuse_file_info *fi) {
+  int rv = storage_file_write(get_file(fi), buf, size, off);
+  log_debug("write(%lu, %ld bytes, @+%ld) -> %d", ino, size, off, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+}
+
+// put the written data straight into the file's blocks in the image's
+// memory, from the request or from the pipe the kernel spliced it into
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t off, struct fuse_file_info *fi) {
+  storage_file_t *file = get_file(fi);
+  size_t size = fuse_buf_size(bufv);
+  int max = storage_file_map_max(size);
+  struct fuse_bufvec *dst = malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+  struct iovec *iov = malloc(max * sizeof(struct iovec));
+  if (dst == NULL || iov == NULL) {
+    free(dst);
+    free(iov);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int count = storage_file_write_map(file, off, size, iov, max);
+  ssize_t rv = count;
+  if (count >= 0) {
+    *dst = FUSE_BUFVEC_INIT(0);
+    dst->count = count == 0 ? 1 : count;
+    for (int i = 0; i < count; i++) {
+      dst->buf[i] = dst->buf[0];
+      dst->buf[i].mem = iov[i].iov_base;
+      dst->buf[i].size = iov[i].iov_len;
+    }
+    rv = fuse_buf_copy(dst, bufv, 0);
+    storage_file_write_done(file, off + (rv > 0 ? rv : 0));
+  }
+  log_debug("write_buf(%lu, %ld bytes, @+%ld) -> %ld", ino, size, off, rv);
+  if (rv < 0) {
+    fuse_reply_err(req, -rv);
+  } else {
+    fuse_reply_write(req, rv);
+  }
+  free(dst);
+  free(iov);
+}
+
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  (void) userdata;
+  conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+  // after fuse_daemonize, so the threads aren't lost in the fork
+  log_start();
+  storage_start();
+}
+
+static void nufs_ll_destroy(void *userdata) {
+  (void) userdata;
+  storage_stop();
+  long hits, misses;
+  dcache_stats(&hits, &misses);
+  log_info("destroy() dentry cache: %ld hits, %ld misses", hits, misses);
+  log_stop();
+}
+
+static void nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init = nufs_ll_init;
+  ops->destroy = nufs_ll_destroy;
+  ops->lookup = nufs_ll_lookup;
+  ops->forget = nufs_ll_forget;
+  ops->forget_multi = nufs_ll_forget_multi;
+  ops->getattr = nufs_ll_getattr;
+  ops->setattr = nufs_ll_setattr;
+  ops->readdir = nufs_ll_readdir;
+  ops->mknod = nufs_ll_mknod;
+  ops->mkdir = nufs_ll_mkdir;
+  ops->unlink = nufs_ll_unlink;
+  ops->rmdir = nufs_ll_rmdir;
+  ops->rename = nufs_ll_rename;
+  ops->link = nufs_ll_link;
+  ops->open = nufs_ll_open;
+  ops->create = nufs_ll_create;
+  ops->release = nufs_ll_release;
+  ops->fsync = nufs_ll_fsync;
+  ops->fsyncdir = nufs_ll_fsyncdir;
+  ops->fallocate = nufs_ll_fallocate;
+  ops->ioctl = nufs_ll_ioctl;
+  ops->read = nufs_ll_read;
+  ops->write = nufs_ll_write;
+  ops->write_buf = nufs_ll_write_buf;
+}
+
+static struct fuse_lowlevel_ops nufs_ll_ops;
+
+int main(int argc, char *argv[]) {
+  assert(argc > 2);
+  // like nufs, the last argument is the disk image
+  storage_init(argv[--argc]);
+  nufs_ll_init_ops(&nufs_ll_ops);
+
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  char *mountpoint;
+  int multithreaded;
+  int foreground;
+  int rv = 1;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+    return 1;
+  }
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch != NULL) {
+    struct fuse_session *se = fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        fuse_daemonize(foreground);
+        rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  fuse_opt_free_args(&args);
+  return rv ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+// Per-operation statistics
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "stats.h"
+
+#define SUB_BITS 2 // each power of two gets 1 << SUB_BITS buckets
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define BUCKETS (64 * SUB_BUCKETS)
+
+// the operation count is the sum of the buckets
+typedef struct op_stats {
+  long errors;
+  long bytes;
+  long total_ns;
+  long max_ns;
+  long buckets[BUCKETS];
+} op_stats_t;
+
+static op_stats_t ops[STATS_OP_COUNT];
+
+static const char *op_names[STATS_OP_COUNT] = {
+  [STATS_ACCESS] = "access",
+  [STATS_GETATTR] = "getattr",
+  [STATS_READDIR] = "readdir",
+  [STATS_MKNOD] = "mknod",
+  [STATS_MKDIR] = "mkdir",
+  [STATS_UNLINK] = "unlink",
+  [STATS_LINK] = "link",
+  [STATS_RMDIR] = "rmdir",
+  [STATS_RENAME] = "rename",
+  [STATS_CHMOD] = "chmod",
+  [STATS_TRUNCATE] = "truncate",
+  [STATS_OPEN] = "open",
+  [STATS_CREATE] = "create",
+  [STATS_RELEASE] = "release",
+  [STATS_FSYNC] = "fsync",
+  [STATS_FSYNCDIR] = "fsyncdir",
+  [STATS_READ] = "read",
+  [STATS_WRITE] = "write",
+  [STATS_FALLOCATE] = "fallocate",
+  [STATS_UTIMENS] = "utimens",
+  [STATS_IOCTL] = "ioctl",
+};
+
+// get the bucket a latency falls in. values below SUB_BUCKETS get a bucket
+// each, after that every power of two is split into SUB_BUCKETS
+static int get_bucket(uint64_t ns) {
+  if (ns < SUB_BUCKETS) {
+    return ns;
+  }
+  int msb = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+  return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+// get the smallest latency that is past the given bucket
+static uint64_t bucket_limit(int bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket + 1;
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t sub = bucket % SUB_BUCKETS;
+  return (SUB_BUCKETS + sub + 1) << shift;
+}
+
+int64_t stats_start() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(stats_op_t op, int64_t start, long rv, long bytes) {
+  long ns = stats_start() - start;
+  op_stats_t *st = &ops[op];
+  if (rv < 0) {
+    __atomic_fetch_add(&st->errors, 1, __ATOMIC_RELAXED);
+  }
+  if (bytes > 0) {
+    __atomic_fetch_add(&st->bytes, bytes, __ATOMIC_RELAXED);
+  }
+  __atomic_fetch_add(&st->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->buckets[get_bucket(ns)], 1, __ATOMIC_RELAXED);
+  long max = __atomic_load_n(&st->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&st->max_ns, &max, ns, 1,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED)) {
+  }
+}
+
+// get the upper bound of the bucket holding the given fraction of the
+// operations, from a copy of the buckets
+static uint64_t percentile(const long *buckets, long count, double p) {
+  long rank = (long) (p * count + 0.5);
+  long seen = 0;
+  for (int ii = 0; ii < BUCKETS; ++ii) {
+    seen += buckets[ii];
+    if (seen >= rank && seen > 0) {
+      return bucket_limit(ii);
+    }
+  }
+  return 0;
+}
+
+char *stats_render(size_t *len) {
+  char *text = NULL;
+  FILE *out = open_memstream(&text, len);
+  if (out == NULL) {
+    return NULL;
+  }
+  for (int op = 0; op < STATS_OP_COUNT; ++op) {
+    // take a copy so the percentiles agree with the counts printed, the
+    // counters keep moving while this runs
+    long buckets[BUCKETS];
+    long count = 0;
+    for (int ii = 0; ii < BUCKETS; ++ii) {
+      buckets[ii] = __atomic_load_n(&ops[op].buckets[ii], __ATOMIC_RELAXED);
+      count += buckets[ii];
+    }
+    fprintf(out, "op %s count %ld errors %ld bytes %ld total_ns %ld max_ns %ld "
+            "p50_ns %lu p90_ns %lu p99_ns %lu\n", op_names[op], count,
+            __atomic_load_n(&ops[op].errors, __ATOMIC_RELAXED),
+            __atomic_load_n(&ops[op].bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&ops[op].total_ns, __ATOMIC_RELAXED),
+            __atomic_load_n(&ops[op].max_ns, __ATOMIC_RELAXED),
+            percentile(buckets, count, 0.50), percentile(buckets, count, 0.90),
+            percentile(buckets, count, 0.99));
+    fprintf(out, "hist %s", op_names[op]);
+    for (int ii = 0; ii < BUCKETS; ++ii) {
+      if (buckets[ii] > 0) {
+        fprintf(out, " %lu:%ld", bucket_limit(ii), buckets[ii]);
+      }
+    }
+    fprintf(out, "\n");
+  }
+  if (fclose(out) != 0) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
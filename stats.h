@@ -0,0 +1,57 @@
+// Per-operation statistics.
+//
+// Every file system operation records its latency, the bytes it moved and
+// whether it failed. Latencies go into log-linear histograms: each power of
+// two is split into 4 equal buckets, so percentiles are within 25% at any
+// scale. Recording only does atomic adds, so threads serving requests never
+// wait on each other for it.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum stats_op {
+  STATS_ACCESS,
+  STATS_GETATTR,
+  STATS_READDIR,
+  STATS_MKNOD,
+  STATS_MKDIR,
+  STATS_UNLINK,
+  STATS_LINK,
+  STATS_RMDIR,
+  STATS_RENAME,
+  STATS_CHMOD,
+  STATS_TRUNCATE,
+  STATS_OPEN,
+  STATS_CREATE,
+  STATS_RELEASE,
+  STATS_FSYNC,
+  STATS_FSYNCDIR,
+  STATS_READ,
+  STATS_WRITE,
+  STATS_FALLOCATE,
+  STATS_UTIMENS,
+  STATS_IOCTL,
+  STATS_OP_COUNT
+} stats_op_t;
+
+// get the time to pass to stats_record when the operation finishes
+// returns: a monotonic timestamp in nanoseconds
+int64_t stats_start();
+
+// record one finished operation
+// param op: the operation
+// param start: the timestamp from stats_start
+// param rv: the result of the operation, negative results count as errors
+// param bytes: the number of bytes read or written
+void stats_record(stats_op_t op, int64_t start, long rv, long bytes);
+
+// write the statistics out as text, one "op" line per operation followed by
+// a "hist" line listing the nonzero buckets as <upper bound ns>:<count>
+// param len: output for the length of the text
+// returns: the text, to be freed by the caller, or NULL if out of memory
+char *stats_render(size_t *len);
+
+#endif
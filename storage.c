@@ -1,213 +1,632 @@
 //Implementation of disc storage, including creation of bitmaps and inode_t table
 
 #include <errno.h>
+#include <limits.h>
 #include "storage.h"
 #include <string.h>
 #include "inode.h"
 #include "directory.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "journal.h"
+#include "log.h"
+#include <pthread.h>
+
+// renames are a link followed by an unlink, this keeps two of them from
+// interleaving on the same names
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Initialize the storage for the file system
 void storage_init(const char *path) {
-  printf("initialize storage with %s as data file", path);
-  // Initialize the data blocks
+  log_info("initialize storage with %s as data file", path);
+  // Initialize the data blocks, reading the image geometry from the
+  // superblock (the bitmaps and inode table are reserved when formatting)
   blocks_init(path);   
+  inode_init();
 
-  // Permanently set aside blocks 1, 2, 3 as inode table blocks
-  for (int i = 1; i <= NUM_INODE_BLOCKS; i++) {
-    // allocate if not already allocated
-    if (!bitmap_get(get_blocks_bitmap(), i)) {
-      alloc_block();
-    }
-  }
   // allocate the root directory the first time
   if (!bitmap_get(get_inode_bitmap(), 0)) {
-    printf("allocate root");
+    log_info("allocate root");
     // allocate inode_t for root by giving it a non-existant parent
     directory_init(-1);
   }
+  // put a new image and the reclaimed orphans on disk
+  journal_commit();
 }
 
+// Start the background work once the frontend has daemonized
+void storage_start() {
+  journal_start();
+}
 
-// Get the inum at a given path
-int get_inum(const char *path) {
-  //printf("get_inum of %s", path);
-  if (strncmp(path, "/", 4) == 0) {
-    //printf(" = 0\n");
-    return 0;
+// Commit what is left and close the image
+void storage_stop() {
+  journal_stop();
+  blocks_free();
+}
+
+
+// copy the path component starting at path into name
+// param end: the end of the part of the path being walked
+// param name: output buffer of DIR_NAME_LENGTH bytes for the component
+// returns: the length of the component, or -ENAMETOOLONG if it doesn't fit
+static int get_component(const char *path, const char *end, char *name) {
+  int len = 0;
+  while (path + len < end && path[len] != '/') {
+    len++;
+  }
+  if (len >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
   }
-  // start from root directory which is inum 0
+  memcpy(name, path, len);
+  name[len] = 0;
+  return len;
+}
+
+// resolve the path up to end one component at a time, starting from the
+// root directory which is inum 0. nothing is allocated, each component is
+// copied into a buffer on the stack for the lookup
+// returns: the inum, or a negative errno
+static int walk_path(const char *path, const char *end) {
   int inum = 0;
-  slist_t *split_path = directory_list(path);
-  slist_t* whole_list = split_path;
-  
-  while (split_path != NULL) {
-    inum = directory_lookup(inum, split_path->data);
+  char name[DIR_NAME_LENGTH];
+  while (path < end) {
+    if (*path == '/') {
+      path++;
+      continue;
+    }
+    int len = get_component(path, end, name);
+    if (len < 0) {
+      return len;
+    }
+    inum = directory_lookup(inum, name);
     if (inum < 0) {
-      printf("%s not found or parent not a dir\n", path);
-      s_free(whole_list);
-      return -ENOENT;
+      return inum;
     }
-    split_path = split_path->next;
+    path += len;
+  }
+  return inum;
+}
+
+// split a path into its parent directory and its last component
+// param leaf: output buffer of DIR_NAME_LENGTH bytes for the last component
+// returns: the inum of the parent directory, or a negative errno
+static int split_path(const char *path, char *leaf) {
+  const char *end = path + strlen(path);
+  // ignore trailing slashes
+  while (end > path && end[-1] == '/') {
+    end--;
+  }
+  const char *start = end;
+  while (start > path && start[-1] != '/') {
+    start--;
+  }
+  // the root has no parent
+  if (start == end) {
+    return -EINVAL;
+  }
+  if (end - start >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  memcpy(leaf, start, end - start);
+  leaf[end - start] = 0;
+  return walk_path(path, start);
+}
+
+// Get the inum at a given path
+int get_inum(const char *path) {
+  int inum = walk_path(path, path + strlen(path));
+  if (inum < 0) {
+    log_debug("%s not found or parent not a dir", path);
   }
-  //printf(" inum = %d\n", inum);
-  s_free(whole_list);
   return inum;
 }
 
+// Get the file information for the inode with the given number
+int storage_stat_inum(int inum, struct stat *st) {
+  if (!bitmap_get(get_inode_bitmap(), inum)) {
+    return -ENOENT;
+  }
+  inode_lock_read(inum);
+  inode_t *node = get_inode(inum);
+  st->st_ino = inum;
+  st->st_mode = node->mode;
+  st->st_nlink = node->refs;
+  st->st_size = node->size;
+  st->st_blocks = (int64_t) (node->num_blocks + inode_delayed_blocks(inum)) * BLOCK_SIZE / 512;
+  st->st_atim = node->access_time;
+  st->st_mtim = node->modification_time;
+  inode_unlock(inum);
+  return 0;
+}
+
 // Get the file information for the file at the specified path
 int storage_stat(const char *path, struct stat *st) {
   int path_inum = get_inum(path);
   if (path_inum >= 0) {
-    inode_t *path_inode = get_inode(path_inum);
-    st->st_ino = path_inum;
-    st->st_mode = path_inode->mode;
-    st->st_nlink = path_inode->refs;
-    st->st_size = path_inode->size;
-    return 0;  
+    return storage_stat_inum(path_inum, st);
   }
 
   return path_inum;
 }
 
+// Read from the inode with the given number
+int storage_read_inum(int inum, char *buf, size_t n, off_t offset) {
+  inode_lock_read(inum);
+  int rv = inode_read(inum, buf, n, n, offset);
+  inode_unlock(inum);
+  return rv;
+}
+
 // Read the specified number of bytes from the given offset in the file at path to the buffer
 int storage_read(const char *path, char *buf, size_t n, size_t size, off_t offset) {
-  printf("Storage_read %ld bytes from %s at offset %ld\n", n, path, offset);
+  log_trace("Storage_read %ld bytes from %s at offset %ld", n, path, offset);
   int path_inum = get_inum(path);
-  return inode_read(path_inum, buf, n, size, offset);
+  if (path_inum < 0) {
+    return path_inum;
+  }
+  return storage_read_inum(path_inum, buf, n > size ? size : n, offset);
+}
+
+// Write to the inode with the given number
+int storage_write_inum(int inum, const char *buf, size_t n, off_t offset) {
+  journal_begin();
+  inode_lock_write(inum);
+  int rv = inode_write(inum, buf, n, offset);
+  inode_unlock(inum);
+  journal_end();
+  return rv;
 }
 
 // Write the specified number of bytes from the given offset in the file at path to the buffer
 int storage_write(const char *path, const char *buf, size_t n, off_t offset) {
-  printf("Storage_write %ld bytes to %s at offset %ld", n, path, offset);
+  log_trace("Storage_write %ld bytes to %s at offset %ld", n, path, offset);
   int path_inum = get_inum(path);
-  return inode_write(path_inum, buf, n, offset);
+  if (path_inum < 0) {
+    return path_inum;
+  }
+  return storage_write_inum(path_inum, buf, n, offset);
+}
+
+// Truncate the inode with the given number to the given size
+int storage_truncate_inum(int inum, off_t size) {
+  journal_begin();
+  inode_lock_write(inum);
+  inode_t *node = get_inode(inum);
+
+  int rv = 0;
+  if (node->size > size){
+    rv = shrink_inode(node, node->size - size);
+  } else if (node->size < size) {
+    rv = grow_inode(node, size - node->size) < 0 ? -ENOSPC : 0;
+  }
+
+  inode_unlock(inum);
+  journal_end();
+  return rv;
 }
 
 // truncate the file at the given path by the given offset
 int storage_truncate(const char *path, off_t size) {
-  printf("Truncate %s by %ld bytes", path, size);
+  log_trace("Truncate %s by %ld bytes", path, size);
   int path_inum = get_inum(path);
   if (path_inum >= 0) {
-    inode_t *path_inode = get_inode(path_inum);
-
-    if (path_inode->size > size){
-	shrink_inode(path_inode, size);
-    }
-
-    return 0;
+    return storage_truncate_inum(path_inum, size);
   }
 
   return -ENOENT;
 }
 
-// Takes a path and isolates the filename from the full directory path
-// param path: the path to split
-// param dir_path: output buffer for parent directory path
-// param filename: the output buffer for file name
-void iso_filename(const char *path, char *dir_path, char *filename) {
-    slist_t *split_path = directory_list(path);
-    memset(dir_path, 0, strnlen(path, 256));
-    memset(filename, 0, strnlen(path, 256));
-    while (split_path->next != NULL) {
-        strncat(dir_path, "/", 256);
-        strncat(dir_path, split_path->data, 256);
-        split_path = split_path->next;
-    }
-
-    char *path_rest = split_path->data;
-    memcpy(filename, path_rest, strnlen(path_rest, 256));
-
-    s_free(split_path);
+// Make a new file system object in the given directory
+int storage_mknod_at(int dir, const char *name, int mode) {
+  if (strnlen(name, DIR_NAME_LENGTH) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  journal_begin();
+  int rv = directory_put(dir, name, mode);
+  journal_end();
+  return rv;
 }
 
 // Make a new file system object (file or directory) at the given path
 int storage_mknod(const char *path, int mode) {
-  printf("Storage_mknod at %s, with mode %04o\n", path, mode);
-  char* parent_path = malloc(sizeof(path));
-  char* filename = malloc(sizeof(path));
-  iso_filename(path, parent_path, filename);
-  int parent = get_inum(parent_path); //lookup parent inum on path
-  int result = directory_put(parent, filename, mode);
-  free(parent_path);
-  free(filename);
+  log_trace("Storage_mknod at %s, with mode %04o", path, mode);
+  char filename[DIR_NAME_LENGTH];
+  int parent = split_path(path, filename);
+  if (parent < 0) {
+    return parent;
+  }
+  int result = storage_mknod_at(parent, filename, mode);
   return result > 0 ? 0 : result;
 }
 
+// Remove the entry with the given name from a directory
+int storage_unlink_at(int dir, const char *name) {
+  journal_begin();
+  int rv = directory_delete(dir, name);
+  journal_end();
+  return rv;
+}
+
 // Remove the file or directory at the given path
 int storage_unlink(const char *path) {
-  printf("Storage_unlink at %s\n", path);
-  int path_inum = get_inum(path);
-  if (path_inum >= 0) {
-    char* dir = malloc(strnlen(path, 256));
-    char* filename = malloc(strnlen(path, 256));
-    iso_filename(path, dir, filename);
+  log_trace("Storage_unlink at %s", path);
+  char filename[DIR_NAME_LENGTH];
+  int dir_inum = split_path(path, filename);
+  if (dir_inum < 0) {
+    return dir_inum;
+  }
+  return storage_unlink_at(dir_inum, filename);
+}
 
-    int dir_inum = get_inum(dir);
-    int ret = directory_delete(dir_inum, filename);
+// Remove the empty directory with the given name from a directory
+int storage_rmdir_at(int dir, const char *name) {
+  journal_begin();
+  int rv = directory_rmdir(dir, name);
+  journal_end();
+  return rv;
+}
 
-    free(dir);
-    free(filename);
-    return ret;
+// Remove the empty directory at the given path
+int storage_rmdir(const char *path) {
+  log_trace("Storage_rmdir at %s", path);
+  char filename[DIR_NAME_LENGTH];
+  int dir_inum = split_path(path, filename);
+  if (dir_inum < 0) {
+    return dir_inum;
   }
+  return storage_rmdir_at(dir_inum, filename);
+}
 
-  return -1;
+// Add a name for an existing inode to the given directory
+int storage_link_at(int dir, const char *name, int target) {
+  if (strnlen(name, DIR_NAME_LENGTH) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  journal_begin();
+  int rv = directory_link(dir, name, target);
+  journal_end();
+  return rv;
 }
 
 // Create a new hard link from the source path to the destination path
 int storage_link(const char *from, const char *to) {
-  printf("storage_link from %s to %s\n", from, to);
+  log_trace("storage_link from %s to %s", from, to);
   int to_inum = get_inum(to);
   // no need to support linking inode 0 because you shouldn't be linking root to something else
   if (to_inum > 0) {
+    char filename[DIR_NAME_LENGTH];
+    int dir_inum = split_path(from, filename);
+    if (dir_inum < 0) {
+      return dir_inum;
+    }
+    return storage_link_at(dir_inum, filename, to_inum);
+  }
 
-    char* dir = malloc(strnlen(from, 128));
-    char* filename = malloc(128);
-    iso_filename(from, dir, filename);
-
-    int dir_inum = get_inum(dir);
-    int ret = directory_link(dir_inum, filename, to_inum);
+  return -1;
+}
 
-    free(dir);
-    free(filename);
-    return ret;
+// rename with rename_lock held, in a transaction
+static int rename_locked(int from_dir, const char *from, int to_dir, const char *to) {
+  int inum = directory_lookup(from_dir, from);
+  if (inum <= 0) {
+    return inum < 0 ? inum : -EBUSY;
+  }
+  int is_dir = (get_inode(inum)->mode & 040000) != 0;
+  int target = directory_lookup(to_dir, to);
+  if (target == inum) {
+    // both names are links to the same inode, which stay as they are
+    return 0;
+  }
+  if (target >= 0) {
+    // renaming over an existing name replaces it, if it is of the same kind
+    int target_dir = (get_inode(target)->mode & 040000) != 0;
+    if (is_dir != target_dir) {
+      return is_dir ? -ENOTDIR : -EISDIR;
+    }
+    int rv = is_dir ? directory_rmdir(to_dir, to) : directory_delete(to_dir, to);
+    if (rv < 0) {
+      return rv;
+    }
+  }
+  int rv = directory_link(to_dir, to, inum);
+  if (rv < 0) {
+    return rv;
   }
+  rv = directory_delete(from_dir, from);
+  if (rv < 0) {
+    directory_delete(to_dir, to);
+    return rv;
+  }
+  // a directory's .. follows it to its new parent
+  if (is_dir && from_dir != to_dir) {
+    rv = directory_set_parent(inum, to_dir);
+    if (rv < 0) {
+      directory_link(from_dir, from, inum);
+      directory_delete(to_dir, to);
+      return rv;
+    }
+  }
+  return 0;
+}
 
-  return -1;
+// Move an entry from one directory to another
+int storage_rename_at(int from_dir, const char *from, int to_dir, const char *to) {
+  if (strnlen(to, DIR_NAME_LENGTH) >= DIR_NAME_LENGTH) {
+    return -ENAMETOOLONG;
+  }
+  // one transaction, so a crash can't leave the entry under both names or neither
+  journal_begin();
+  pthread_mutex_lock(&rename_lock);
+  int rv = rename_locked(from_dir, from, to_dir, to);
+  pthread_mutex_unlock(&rename_lock);
+  journal_end();
+  return rv;
 }
 
 // Rename the file or directory at the given path to the new path
 int storage_rename(const char *from, const char *to) {
-  printf("storage_rename %s to %s\n", from, to);
-  int from_inum = get_inum(from);
-  if (from_inum > 0) {
-    storage_link(to, from);
-    storage_unlink(from);
-    
-    return 0;
+  log_trace("storage_rename %s to %s", from, to);
+  char from_name[DIR_NAME_LENGTH];
+  char to_name[DIR_NAME_LENGTH];
+  int from_dir = split_path(from, from_name);
+  if (from_dir < 0) {
+    return from_dir;
   }
+  int to_dir = split_path(to, to_name);
+  if (to_dir < 0) {
+    return to_dir;
+  }
+  return storage_rename_at(from_dir, from_name, to_dir, to_name);
+}
 
-  return -1;
+// Set the access and modification times of the inode with the given number
+int storage_set_time_inum(int inum, const struct timespec ts[2]) {
+  journal_begin();
+  inode_lock_write(inum);
+  inode_t *node = get_inode(inum);
+  inode_dirty(node);
+  node->access_time = ts[0];
+  node->modification_time = ts[1];
+  inode_unlock(inum);
+  journal_end();
+  return 0;
 }
 
 // Set the access and modification times for the specified path
 int storage_set_time(const char *path, const struct timespec ts[2]) {
-  printf("Storage_set_time for file %s at atime: %ld, mtime %ld", path, ts[0].tv_sec, ts[1].tv_sec);
+  log_trace("Storage_set_time for file %s at atime: %ld, mtime %ld", path, ts[0].tv_sec, ts[1].tv_sec);
   int path_inum = get_inum(path);
   if (path_inum > 0) {
-    inode_t *path_inode = get_inode(path_inum);
-    path_inode->access_time = ts[0];
-    path_inode->modification_time = ts[1];
-    
-    return 0;
+    return storage_set_time_inum(path_inum, ts);
   }
 
   return -1;
 }
 
+// Give back pins taken by a lookup, freeing the inode if it has no links left
+void storage_unpin(int inum, long count) {
+  journal_begin();
+  inode_unpin(inum, count);
+  journal_end();
+}
+
+// Make a handle for an inode that is already pinned
+static storage_file_t *new_file(int inum) {
+  storage_file_t *file = calloc(1, sizeof(storage_file_t));
+  if (file == NULL) {
+    storage_unpin(inum, 1);
+    return NULL;
+  }
+  file->inum = inum;
+  file->node = get_inode(inum);
+  return file;
+}
+
+// Resolve the path and pin the inode it names
+static int get_inum_pin(const char *path) {
+  char filename[DIR_NAME_LENGTH];
+  int parent = split_path(path, filename);
+  if (parent == -EINVAL) {
+    // the root, which is never freed
+    inode_pin(0, 1);
+    return 0;
+  }
+  if (parent < 0) {
+    return parent;
+  }
+  return directory_lookup_pin(parent, filename);
+}
+
+// Open the file at the given path
+int storage_open(const char *path, storage_file_t **file) {
+  int inum = get_inum_pin(path);
+  if (inum < 0) {
+    return inum;
+  }
+  *file = new_file(inum);
+  return *file == NULL ? -ENOMEM : 0;
+}
+
+// Open the inode with the given number
+int storage_open_inum(int inum, storage_file_t **file) {
+  if (!bitmap_get(get_inode_bitmap(), inum)) {
+    return -ENOENT;
+  }
+  inode_pin(inum, 1);
+  *file = new_file(inum);
+  return *file == NULL ? -ENOMEM : 0;
+}
+
+// Make a new file at the given path and open it
+int storage_create(const char *path, int mode, storage_file_t **file) {
+  int rv = storage_mknod(path, mode);
+  if (rv < 0) {
+    return rv;
+  }
+  return storage_open(path, file);
+}
+
+// Close an open file
+void storage_close(storage_file_t *file) {
+  storage_unpin(file->inum, 1);
+  free(file);
+}
+
+// Read from an open file
+int storage_file_read(storage_file_t *file, char *buf, size_t n, off_t offset) {
+  inode_lock_read(file->inum);
+  int rv = inode_read_hint(file->inum, &file->hint, buf, n, offset);
+  inode_unlock(file->inum);
+  return rv;
+}
+
+// Map part of an open file to the image's memory
+int storage_file_map(storage_file_t *file, off_t offset, size_t n, struct iovec *iov, int max_iov) {
+  inode_lock_read(file->inum);
+  int rv = inode_read_map(file->inum, &file->hint, offset, n, iov, max_iov);
+  if (rv < 0) {
+    inode_unlock(file->inum);
+  }
+  return rv;
+}
+
+// Runs of blocks are at least a block long, so besides the partial blocks at
+// either end every block can start a new one
+int storage_file_map_max(size_t n) {
+  return n / BLOCK_SIZE + 2;
+}
+
+void storage_file_unmap(storage_file_t *file) {
+  inode_unlock(file->inum);
+}
+
+// Map part of an open file to the image's memory for writing, in a
+// transaction that lasts until the write is done
+int storage_file_write_map(storage_file_t *file, off_t offset, size_t n, struct iovec *iov, int max_iov) {
+  journal_begin();
+  inode_lock_write(file->inum);
+  int rv = inode_write_map(file->inum, &file->hint, offset, n, iov, max_iov);
+  if (rv < 0) {
+    inode_unlock(file->inum);
+    journal_end();
+  }
+  return rv;
+}
+
+void storage_file_write_done(storage_file_t *file, off_t end) {
+  inode_write_done(file->inum, end);
+  inode_unlock(file->inum);
+  journal_end();
+}
+
+// Write to an open file
+int storage_file_write(storage_file_t *file, const char *buf, size_t n, off_t offset) {
+  journal_begin();
+  inode_lock_write(file->inum);
+  int rv = inode_write_hint(file->inum, &file->hint, buf, n, offset);
+  inode_unlock(file->inum);
+  journal_end();
+  return rv;
+}
+
+// check a range for fallocate, block numbers within files are ints
+static int check_range(off_t offset, off_t len) {
+  if (offset < 0 || len <= 0) {
+    return -EINVAL;
+  }
+  if (len > (int64_t) INT_MAX * BLOCK_SIZE - offset) {
+    return -EFBIG;
+  }
+  return 0;
+}
+
+// Preallocate blocks for an open file
+int storage_file_allocate(storage_file_t *file, off_t offset, off_t len, int keep_size) {
+  int rv = check_range(offset, len);
+  if (rv < 0) {
+    return rv;
+  }
+  journal_begin();
+  inode_lock_write(file->inum);
+  rv = inode_allocate(file->node, offset, len, keep_size) < 0 ? -ENOSPC : 0;
+  inode_unlock(file->inum);
+  journal_end();
+  return rv;
+}
+
+// Punch a hole in an open file
+int storage_file_punch(storage_file_t *file, off_t offset, off_t len) {
+  int rv = check_range(offset, len);
+  if (rv < 0) {
+    return rv;
+  }
+  journal_begin();
+  inode_lock_write(file->inum);
+  rv = inode_punch(file->node, offset, len) < 0 ? -ENOSPC : 0;
+  inode_unlock(file->inum);
+  journal_end();
+  return rv;
+}
+
+// Find data or a hole in an open file
+int64_t storage_file_seek(storage_file_t *file, int64_t offset, int hole) {
+  inode_lock_read(file->inum);
+  int64_t rv = inode_seek(file->node, offset, hole);
+  inode_unlock(file->inum);
+  return rv;
+}
+
+// Write the changed data of an open file in place, a batch of runs at a time
+static int sync_data(storage_file_t *file) {
+  struct iovec iov[64];
+  int count = 0;
+  // inline data is in the inode
+  int blocks = file->node->flags & INODE_INLINE ? 0 : bytes_to_blocks(file->node->size);
+  for (int file_bnum = 0; file_bnum < blocks;) {
+    int run;
+    int bnum = inode_map(file->node, file_bnum, &run);
+    if (run > blocks - file_bnum) {
+      run = blocks - file_bnum;
+    }
+    if (bnum < 0) {
+      file_bnum += run;
+      continue;
+    }
+    iov[count].iov_base = blocks_addr(bnum);
+    iov[count].iov_len = (size_t) run * BLOCK_SIZE;
+    file_bnum += run;
+    if (journal_is_dirty(iov[count].iov_base, iov[count].iov_len) && ++count == 64) {
+      int rv = journal_sync_data(iov, count);
+      if (rv < 0) {
+        return rv;
+      }
+      count = 0;
+    }
+  }
+  return count > 0 ? journal_sync_data(iov, count) : 0;
+}
+
+// Make an open file durable. While its inode is unchanged since the last
+// commit, so are its size and the blocks it maps to, and only the data
+// written since needs to go out; otherwise it takes a commit
+int storage_file_sync(storage_file_t *file) {
+  journal_begin();
+  inode_lock_read(file->inum);
+  // delayed blocks are only given their place by a commit
+  int changed = inode_changed(file->inum) || inode_delayed_blocks(file->inum) > 0;
+  int rv = changed ? 0 : sync_data(file);
+  inode_unlock(file->inum);
+  journal_end();
+  return changed ? journal_commit() : rv;
+}
+
+int storage_sync() {
+  return journal_commit();
+}
+
 // Get a list of the contents of the directory at the given path
 slist_t *storage_list(const char *path) {
-  printf("storage_list with path %s\n", path);
+  log_trace("storage_list with path %s", path);
   return directory_list(path);
 }
@@ -12,16 +12,47 @@
 #include <time.h>
 #include <unistd.h>
 #include "slist.h"
+#include "inode.h"
 
-// initialize the file system at the given file path
+// an open file, kept in the fh of fuse_file_info from open until release
+// so reads and writes don't resolve the path again. the inode stays
+// allocated while the handle is open, even if it is unlinked
+typedef struct storage_file {
+  int inum;              // the inode number
+  inode_t *node;         // the inode
+  inode_map_hint_t hint; // the last extent the handle mapped
+} storage_file_t;
+
+// initialize the file system at the given file path, replaying the journal
+// if it was not stopped cleanly
 // param path: the file path as a string
 void storage_init(const char *path);
 
-// get the inode number for the given path
+// start the thread committing changes in the background. call after
+// daemonizing, until then changes are committed when the journal fills up
+void storage_start();
+
+// commit all changes and close the image. changes made since the last
+// commit are lost if the process ends without this
+void storage_stop();
+
+// each function below that changes the file system runs in one journal
+// transaction, so after a crash it has either happened completely or not at all
+
+// get the inode number for the given path, without allocating memory
 // param: path: the file path to get inode number for
-// returns: the inode number or -1 if the file doesn't exist
+// returns: the inode number or a negative errno if the file doesn't exist
 int get_inum(const char *path);
 
+// the functions ending in _inum or _at take inode numbers instead of paths, for
+// callers that already know them. they don't resolve any names
+
+// get the file information for the inode with the given number
+// param inum: the inode number
+// param st: a pointer to a stat struct to store the result in
+// returns: 0 if successful, -ENOENT if the inode is not in use
+int storage_stat_inum(int inum, struct stat *st);
+
 // get the file information for the file at the specified path
 // param path: the file path as a string
 // param st: a pointer to a stat struct to store the result in
@@ -37,6 +68,10 @@ int storage_stat(const char *path, struct stat *st);
 // returns: number of bytes read if the read was successful, -1 if the specified file and offset couldn't be accessed
 int storage_read(const char *path, char *buf, size_t n, size_t size, off_t offset);
 
+// read up to n bytes from the given offset in the inode with the given number
+// returns: number of bytes read, or a negative errno
+int storage_read_inum(int inum, char *buf, size_t n, off_t offset);
+
 
 // write the specified number of bytes from the given offset in the file at path to the buffer.
 // param path: the file path to write to as a string
@@ -46,12 +81,20 @@ int storage_read(const char *path, char *buf, size_t n, size_t size, off_t offse
 // returns: number of bytes written if the write was successful, -1 if the specified file and offset couldn't be accessed
 int storage_write(const char *path, const char *buf, size_t n, off_t offset);
 
+// write n bytes at the given offset in the inode with the given number
+// returns: number of bytes written, or a negative errno
+int storage_write_inum(int inum, const char *buf, size_t n, off_t offset);
+
 // truncate the file at the given path to the given size
 // param path: the file path to truncate as a string
 // param size: the size to truncate the file to
 // returns: 0 if successful and -1 if unsuccessful
 int storage_truncate(const char *path, off_t size);
 
+// truncate the inode with the given number to the given size
+// returns: 0 if successful, a negative errno otherwise
+int storage_truncate_inum(int inum, off_t size);
+
 // make a new file system object (file or directory) at the given path
 // param path: the file path to create a new file or directory at
 // param mode: the octal representation of the mode for the new object
@@ -59,29 +102,169 @@ int storage_truncate(const char *path, off_t size);
 // returns: 0 if successful, -1 otherwise
 int storage_mknod(const char *path, int mode);
 
+// make a new file system object with the given name in a directory
+// param dir: the inode number of the directory
+// param name: the name of the new object
+// param mode: the mode of the new object
+// returns: the inode number of the new object, or a negative errno
+int storage_mknod_at(int dir, const char *name, int mode);
+
 // remove the file or directory at the given path
 // param path: the file path to remove
 // returns: 0 if successful, -1 otherwise
 int storage_unlink(const char *path);
 
+// remove the entry with the given name from a directory
+// param dir: the inode number of the directory
+// param name: the name of the entry
+// returns: 0 if successful, a negative errno otherwise
+int storage_unlink_at(int dir, const char *name);
+
+// remove the empty directory at the given path
+// param path: the path of the directory
+// returns: 0 if successful, -ENOTEMPTY if it has entries, another negative errno otherwise
+int storage_rmdir(const char *path);
+
+// remove the empty directory with the given name from a directory
+// param dir: the inode number of the directory holding it
+// param name: the name of the directory
+// returns: 0 if successful, -ENOTEMPTY if it has entries, another negative errno otherwise
+int storage_rmdir_at(int dir, const char *name);
+
 // create a new hard link from the source path to the destination path, i.e. making the source path point to the inode of the destination path
 // param from: the file path to turn into a hard link
 // param to: the file path to link to
 // returns: 0 if successful, -1 otherwise
 int storage_link(const char *from, const char *to);
 
+// add a name for an existing inode to a directory
+// param dir: the inode number of the directory
+// param name: the new name
+// param target: the inode number to link to
+// returns: the target's inode number, or a negative errno
+int storage_link_at(int dir, const char *name, int target);
+
 // rename the file or directory at the given path to the new path
 // param from: the file path to rename
 // param to: the file path to rename to
-// returns: 0 if successful, -1 otherwise
+// returns: 0 if successful, a negative errno otherwise
 int storage_rename(const char *from, const char *to);
 
+// move an entry to a new name, possibly in another directory, replacing any
+// entry that already has the new name
+// param from_dir: the inode number of the directory holding the entry
+// param from: the name of the entry
+// param to_dir: the inode number of the directory to move it to
+// param to: the new name
+// returns: 0 if successful, a negative errno otherwise
+int storage_rename_at(int from_dir, const char *from, int to_dir, const char *to);
+
 // set the access and modification times for the specified path
 // param path: the file to update access or modification times for
 // param ts: an array of two timespec structs representing access time and modification time
 // returns: 0 if successful, -1 otherwise
 int storage_set_time(const char *path, const struct timespec ts[2]);
 
+// set the access and modification times of the inode with the given number
+// returns: 0
+int storage_set_time_inum(int inum, const struct timespec ts[2]);
+
+// open the file at the given path
+// param path: the file path to open
+// param file: output for the new handle
+// returns: 0 if successful, a negative errno otherwise
+int storage_open(const char *path, storage_file_t **file);
+
+// open the inode with the given number
+// param inum: the inode number
+// param file: output for the new handle
+// returns: 0 if successful, a negative errno otherwise
+int storage_open_inum(int inum, storage_file_t **file);
+
+// make a new file at the given path and open it
+// param path: the file path to create
+// param mode: the mode of the new file
+// param file: output for the new handle
+// returns: 0 if successful, a negative errno otherwise
+int storage_create(const char *path, int mode, storage_file_t **file);
+
+// close a handle returned by storage_open, storage_open_inum or storage_create
+// param file: the handle
+void storage_close(storage_file_t *file);
+
+// give back pins taken with directory_lookup_pin or inode_pin, freeing the
+// inode if it was unlinked and this was the last pin
+// param inum: the inode number
+// param count: the number of pins
+void storage_unpin(int inum, long count);
+
+// read up to n bytes from the given offset in an open file
+// returns: number of bytes read, or a negative errno
+int storage_file_read(storage_file_t *file, char *buf, size_t n, off_t offset);
+
+// find where up to n bytes at the given offset in an open file are in the
+// image's memory, so they can be replied with without copying them. the file
+// is read locked until storage_file_unmap, unless this fails
+// param iov: output for the pieces of the range, contiguous in memory
+// param max_iov: the size of iov, storage_file_map_max(n) is always enough
+// returns: the number of iovecs filled, or a negative errno
+int storage_file_map(storage_file_t *file, off_t offset, size_t n, struct iovec *iov, int max_iov);
+
+// the most iovecs storage_file_map can need for n bytes
+int storage_file_map_max(size_t n);
+
+// release the lock taken by storage_file_map once the memory is not used any more
+void storage_file_unmap(storage_file_t *file);
+
+// allocate the blocks for writing n bytes at the given offset in an open
+// file and find where they are in the image's memory, so the data can be put
+// there without an intermediate copy. the file stays write locked, and the
+// transaction open, until storage_file_write_done, unless this fails
+// param iov: output for the pieces of the range, contiguous in memory
+// param max_iov: the size of iov, storage_file_map_max(n) is always enough
+// returns: the number of iovecs filled, or a negative errno
+int storage_file_write_map(storage_file_t *file, off_t offset, size_t n, struct iovec *iov, int max_iov);
+
+// finish a write started by storage_file_write_map, growing the file to
+// cover the bytes that were written and releasing the lock
+// param end: the offset after the last byte written
+void storage_file_write_done(storage_file_t *file, off_t end);
+
+// write n bytes at the given offset in an open file
+// returns: number of bytes written, or a negative errno
+int storage_file_write(storage_file_t *file, const char *buf, size_t n, off_t offset);
+
+// allocate the blocks for len bytes of an open file at offset, like
+// fallocate. the blocks are as contiguous on disk as the free space allows,
+// so a file written into the range afterwards isn't fragmented and the
+// writes allocate nothing. the range reads as zeros where it was a hole
+// param keep_size: 1 to leave the size alone, like FALLOC_FL_KEEP_SIZE,
+//                  otherwise the file grows to cover the range
+// returns: 0 if successful, a negative errno otherwise
+int storage_file_allocate(storage_file_t *file, off_t offset, off_t len, int keep_size);
+
+// turn len bytes of an open file at offset into a hole that reads as zeros,
+// freeing the blocks it covers, like fallocate with FALLOC_FL_PUNCH_HOLE.
+// the size doesn't change
+// returns: 0 if successful, a negative errno otherwise
+int storage_file_punch(storage_file_t *file, off_t offset, off_t len);
+
+// find where data or a hole starts in an open file at or after offset, like
+// lseek with SEEK_DATA or SEEK_HOLE. the end of the file counts as a hole
+// param hole: 0 to find data, 1 to find a hole
+// returns: the offset, or -ENXIO if offset is past the end or no data follows it
+int64_t storage_file_seek(storage_file_t *file, int64_t offset, int hole);
+
+// make everything written to an open file durable, data and metadata. this
+// only writes the file's own data when nothing else about it changed since
+// the last commit, and commits otherwise
+// returns: 0 if successful, -EIO if writing the image failed
+int storage_file_sync(storage_file_t *file);
+
+// commit every change made so far and wait for it to be on disk
+// returns: 0 if successful, -EIO if writing the image failed
+int storage_sync();
+
 // get a list of the contents of the directory at the given path
 // param path: the directory t list contents of
 // returns: an slist containing the names of files and subdirectories in the directory
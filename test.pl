@@ -2,11 +2,15 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 31;
+use Test::More tests => 43;
 use IO::Handle;
 
+# the frontend to mount the images with, nufs or nufs_ll
+my $frontend = $ARGV[0] // "nufs";
+my $mount_target = $frontend eq "nufs_ll" ? "mount_ll" : "mount";
+
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    system("(make $mount_target 2>&1) >> test.log &");
     #system("(make gdb)");
     sleep 1;
 }
@@ -44,7 +48,7 @@ sub read_text_slice {
 
 system("rm -f data.nufs test.log");
 
-say "#           == Basic Tests ==";
+say "#           == Basic Tests ($frontend) ==";
 mount();
 
 my $msg0 = "hello, one";
@@ -133,6 +137,77 @@ ok(-e "mnt/foo/file.txt", "Move a file to another directory");
 system("(echo SEARCH_FOR_THIS_IN_LOG) >> test.log");
 my $msg6 = read_text("foo/file.txt");
 ok($msg4 eq $msg6, "Read data back correctly");
+ok(!rmdir("mnt/foo") && -d "mnt/foo/bar", "Can't remove a directory that isn't empty");
+
+say "# Many directory entries";
+
+mkdir("mnt/many");
+for my $ii (1..40) {
+    write_text("many/f$ii.txt", "entry $ii");
+}
+my @entries = split /\s+/, `ls mnt/many`;
+ok(scalar(@entries) == 40 && read_text("many/f40.txt") eq "entry 40",
+   "Directory holds more than one block of entries");
+
+SKIP: {
+    skip "only nufs serves statistics", 1 if $frontend ne "nufs";
+    my $stats = read_text(".nufs/stats");
+    ok($stats =~ /^op write count [1-9]\d* errors \d+ bytes [1-9]/m,
+       "Operation statistics are readable");
+}
+
+# a small file kept in the inode moves to a block when it grows
+write_text("small.txt", "tiny");
+open my $afh, ">>", "mnt/small.txt";
+$afh->print("x" x 100);
+close $afh;
+ok(read_text("small.txt") eq "tiny\n" . ("x" x 100), "Small file grows out of its inode");
+
+# only written blocks are allocated, so this fits in the 1 MB image
+open my $hfh, ">", "mnt/sparse.bin";
+seek $hfh, 8 << 20, 0;
+$hfh->print("end");
+close $hfh;
+ok(-s "mnt/sparse.bin" == (8 << 20) + 3 &&
+   read_text_slice("sparse.bin", 4, 4 << 20) eq "\0" x 4 &&
+   read_text_slice("sparse.bin", 3, 8 << 20) eq "end", "Sparse file reads back holes as zeros");
+
+# NUFS_IOC_SEEK_DATA from nufs_ioctl.h
+open $hfh, "<", "mnt/sparse.bin";
+my $pos = pack("q", 0);
+my $seeked = ioctl($hfh, 0xC0084E01, $pos);
+close $hfh;
+ok($seeked && unpack("q", $pos) == 8 << 20, "SEEK_DATA skips the hole");
+
+# fallocate reserves the blocks up front, punching a hole frees them again
+system("fallocate -l 256K mnt/prealloc.bin");
+my $reserved = (stat "mnt/prealloc.bin")[12];
+system("fallocate -p -o 0 -l 128K mnt/prealloc.bin");
+ok(-s "mnt/prealloc.bin" == 256 << 10 && $reserved == 512 &&
+   (stat "mnt/prealloc.bin")[12] == 256 &&
+   read_text_slice("prealloc.bin", 4, 0) eq "\0" x 4, "fallocate preallocates and punches holes");
+
+sub image_has {
+    my ($text) = @_;
+    open my $fh, "<", "data.nufs" or return 0;
+    local $/ = undef;
+    my $image = <$fh>;
+    close $fh;
+    return index($image, $text) >= 0;
+}
+
+# the first sync commits the new file, the second only writes its data
+open my $sfh, "+>", "mnt/synced.txt";
+$sfh->print("first synced text");
+$sfh->flush;
+$sfh->sync;
+my $first = image_has("first synced text");
+seek $sfh, 0, 0;
+$sfh->print("other synced text");
+$sfh->flush;
+$sfh->sync;
+close $sfh;
+ok($first && image_has("other synced text"), "fsync writes data to the image");
 
 unmount();
 
@@ -173,5 +248,43 @@ ok(($listed and $exists and $has_size), "Larger file exists and has the correct
 $back = read_text("larger.txt");
 ok($content eq $back, "Read back data from larger file correctly");
 
-unmount()
+say "# -> 129 blocks";
+$chunks = 128 * 256;
+$content = "1_2_3_4_5_6_7_8_" x $chunks; # $chunks * 16 bytes of data
+write_text("huge.txt", $content);
+$size = -s "mnt/huge.txt";
+$size or $size = 0;
+say "# Actual size: $size";
+ok($size eq 16 * $chunks + 1, "Huge file has the correct size");
+$back = read_text("huge.txt");
+ok($content eq $back, "Read back data from huge file correctly");
 
+unmount();
+
+say "# Block backends";
+
+$ENV{NUFS_BACKEND} = "direct";
+mount();
+$back = read_text("huge.txt");
+ok($content eq $back, "Read back data from huge file with the direct backend");
+unmount();
+delete $ENV{NUFS_BACKEND};
+
+
+say "# Journal replay";
+
+# nufs exits once the fsync's commit is in the journal, before any of it is
+# in place, so only the replay on the next mount can bring the file back
+$ENV{NUFS_CRASH_AFTER_JOURNAL} = 1;
+mount();
+open my $cfh, ">", "mnt/replayed.txt";
+$cfh->print("kept by the journal");
+$cfh->flush;
+$cfh->sync;
+close $cfh;
+delete $ENV{NUFS_CRASH_AFTER_JOURNAL};
+unmount();
+mount();
+ok(read_text("replayed.txt") eq "kept by the journal" && read_text("huge.txt") eq $content,
+   "A commit cut off after the journal write is replayed");
+unmount();
@@ -0,0 +1,232 @@
+// Batched block I/O through io_uring
+//
+// The submission ring holds indexes into the array of submission queue
+// entries, which here always match the ring slots. This thread is the only
+// one producing to its ring and consuming from its completion ring, so the
+// only ordering needed is with the kernel: the tail of the submission ring
+// is published after the entries are filled in, and completions are read
+// after loading the tail of the completion ring.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "uring.h"
+
+typedef struct uring {
+  int fd;
+  unsigned gen; // the uring_init the ring was set up for
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned entries;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+} uring_t;
+
+static int file_fd = -1;
+static int enabled = 0;
+static unsigned gen = 0;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static __thread uring_t *ring = NULL;
+
+static void ring_free(void *arg) {
+  uring_t *r = arg;
+  if (r->sqes != NULL) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr != NULL) {
+    munmap(r->sq_ptr, r->sq_len);
+  }
+  close(r->fd);
+  free(r);
+}
+
+static void make_key() {
+  pthread_key_create(&ring_key, ring_free);
+}
+
+// map the rings of a new io_uring instance and register the file with it
+// returns: the ring, or NULL if the kernel won't give one
+static uring_t *ring_new() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (fd < 0) {
+    log_debug("uring: io_uring_setup failed: %s", strerror(errno));
+    return NULL;
+  }
+  uring_t *r = calloc(1, sizeof(uring_t));
+  if (r == NULL) {
+    close(fd);
+    return NULL;
+  }
+  r->fd = fd;
+  r->gen = gen;
+  r->entries = p.sq_entries;
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cq_len > r->sq_len) {
+    r->sq_len = r->cq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    ring_free(r);
+    return NULL;
+  }
+  r->cq_ptr = single ? r->sq_ptr
+                     : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            fd, IORING_OFF_CQ_RING);
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd, IORING_OFF_SQES);
+  if (r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED) {
+    r->cq_ptr = r->cq_ptr == MAP_FAILED ? NULL : r->cq_ptr;
+    r->sqes = r->sqes == MAP_FAILED ? NULL : r->sqes;
+    ring_free(r);
+    return NULL;
+  }
+  char *sq = r->sq_ptr;
+  char *cq = r->cq_ptr;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // the file is looked up once here rather than on every operation
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, &file_fd, 1) < 0) {
+    log_debug("uring: registering the file failed: %s", strerror(errno));
+    ring_free(r);
+    return NULL;
+  }
+  return r;
+}
+
+// get this thread's ring, setting it up the first time
+static uring_t *get_ring() {
+  if (ring != NULL && ring->gen != gen) {
+    ring_free(ring);
+    ring = NULL;
+  }
+  if (ring == NULL) {
+    ring = ring_new();
+    pthread_setspecific(ring_key, ring);
+  }
+  return ring;
+}
+
+int uring_init(int fd) {
+  const char *env = getenv("NUFS_IO_URING");
+  if (env != NULL && strcmp(env, "0") == 0) {
+    return -1;
+  }
+  pthread_once(&key_once, make_key);
+  file_fd = fd;
+  gen++;
+  enabled = get_ring() != NULL;
+  return enabled ? 0 : -1;
+}
+
+void uring_stop() {
+  enabled = 0;
+  if (ring != NULL) {
+    ring_free(ring);
+    ring = NULL;
+    pthread_setspecific(ring_key, NULL);
+  }
+}
+
+// move the completions that arrived into the ios they belong to
+// returns: the number of completions
+static int reap(uring_t *r, uring_io_t *ios) {
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  int count = 0;
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    ios[cqe->user_data].res = cqe->res;
+    head++;
+    count++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+// submit a batch that fits in the ring and wait for all of it
+// returns: 0 if successful, -1 if the ring failed
+static int submit(uring_t *r, uring_io_t *ios, int count, int write) {
+  unsigned tail = *r->sq_tail;
+  for (int ii = 0; ii < count; ii++) {
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0; // the index of the registered file
+    sqe->addr = (uint64_t) (uintptr_t) ios[ii].buf;
+    sqe->len = ios[ii].len;
+    sqe->off = ios[ii].pos;
+    sqe->user_data = ii;
+    r->sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+  int submitted = 0;
+  int completed = 0;
+  while (completed < count) {
+    completed += reap(r, ios);
+    if (completed == count) {
+      break;
+    }
+    int rv = syscall(__NR_io_uring_enter, r->fd, count - submitted, count - completed,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rv < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_error("uring: io_uring_enter failed: %s", strerror(errno));
+      return -1;
+    }
+    submitted += rv;
+  }
+  return 0;
+}
+
+int uring_rw(uring_io_t *ios, int count, int write) {
+  uring_t *r = enabled ? get_ring() : NULL;
+  if (r == NULL) {
+    return -1;
+  }
+  for (int done = 0; done < count;) {
+    int batch = count - done < (int) r->entries ? count - done : (int) r->entries;
+    if (submit(r, ios + done, batch, write) < 0) {
+      // the next submission sets up a new ring
+      ring_free(ring);
+      ring = NULL;
+      pthread_setspecific(ring_key, NULL);
+      return -1;
+    }
+    done += batch;
+  }
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Batched block I/O through io_uring.
+//
+// Reads and writes of the image file are queued on a ring shared with the
+// kernel and submitted together, so a batch of runs costs one system call
+// and the device sees all of them at once instead of one at a time. The
+// ring is set up with the raw system calls, there's no library to depend
+// on. Each thread gets a ring of its own the first time it submits, with
+// the image registered as a fixed file.
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define URING_ENTRIES 64 // most operations one submission carries
+
+// one read or write of a batch
+typedef struct uring_io {
+  void *buf;   // the memory to read into or write from
+  size_t len;  // the number of bytes
+  int64_t pos; // the position in the file
+  int res;     // output: the number of bytes transferred, or a negative errno
+} uring_io_t;
+
+// start doing I/O on the given file through io_uring, if the kernel has it
+// param fd: the file, usually the image
+// returns: 0 if successful, -1 if io_uring can't be used
+int uring_init(int fd);
+
+// read or write a batch of ranges of the file given to uring_init, waiting
+// for all of them. like pread and pwrite, a range can be cut short
+// param ios: the ranges, their res is filled in as they complete
+// param count: the number of ranges
+// param write: 1 to write, 0 to read
+// returns: 0 if successful, -1 if the ring couldn't be used. the res of
+//          ranges that didn't complete is left alone then
+int uring_rw(uring_io_t *ios, int count, int write);
+
+// stop using io_uring. the rings of threads are torn down as they exit, or
+// when they next submit after another uring_init
+void uring_stop();
+
+#endif